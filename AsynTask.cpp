@@ -1,313 +1,3465 @@
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <numeric>
 #include <queue>
 #include <random>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include "Common.h"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// Per-thread counters and latency histograms behind AsyncTask::Stats(). Define ASYNCTASK_STATS as 0 to compile them out.
+#ifndef ASYNCTASK_STATS
+#define ASYNCTASK_STATS 1
+#endif
+// Task tracing behind AsyncTask::StartTrace(), off until started. Define ASYNCTASK_TRACE as 0 to compile it out.
+#ifndef ASYNCTASK_TRACE
+#define ASYNCTASK_TRACE 1
+#endif
 
 namespace Utils {
 
-/*  Examples:
-    {
-        AsyncTaskHelper ath;
-        ath.AddTask([&ath](){
-            // do something.
-            ath.AddTask([](){
-                //do something.
-            });
-        });
-        ath.AddTask(std::bind(...));
-        ath.WaitForComplete(); // WaitForComplete can be called many times.
-    } // Blocked here by WaitForComplete in dtor.
-*/
-class AsyncTask {
+// Bounded multi-producer multi-consumer queue (Dmitry Vyukov's array queue). Every cell carries a sequence number that
+// tells producers and consumers whose turn it is, so TryPush and TryPop are a single CAS on the tail or head in the
+// common case and never block each other. Capacity is rounded up to a power of two.
+template <typename T>
+class MpmcQueue {
 private:
-    using Task = std::function<void()>;
-    using Lock = std::unique_lock<std::mutex>;
+    static constexpr size_t CACHE_LINE = 64;
 
-public:
-    /// \brief Constructor,
-    /// Parameters:
-    ///     maxthread: the number of threads in the threadpool, default value of the number of processors is not optimal.
-    AsyncTask(size_t maxthread = std::thread::hardware_concurrency()) noexcept;
-    ~AsyncTask();
+    struct Cell {
+        std::atomic<size_t> m_Sequence;
+        T m_Data;
+    };
 
-    inline size_t MaxConcurrency() {
-        return m_Threads.size();
+public:
+    explicit MpmcQueue(size_t capacity) : m_Mask(RoundUp(capacity) - 1), m_Cells(new Cell[m_Mask + 1]), m_Tail(0), m_Head(0) {
+        for (size_t i = 0; i <= m_Mask; ++i) {
+            m_Cells[i].m_Sequence.store(i, std::memory_order_relaxed);
+        }
     }
 
-    inline explicit operator bool() {
-        return !m_StopRunning;
+    inline size_t Capacity() const {
+        return m_Mask + 1;
     }
 
-    /// \brief Add new task to queue. Can called from Task.
-    void AddTask(Task&& task);
-
-    /// \brief Shut down task queue. Can called from any thread.
-    /// Parameters:
-    ///     force:  true, forbid adding new task and clear pending tasks, waiting for running task.
-    ///             false, forbid adding new task and waiting for running task and pending task.
-    void Shutdown(bool force = false);
+    /// \brief Returns false when the queue is full, value is left untouched in that case.
+    bool TryPush(T&& value) {
+        size_t pos = m_Tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = m_Cells[pos & m_Mask];
+            size_t seq = cell.m_Sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (m_Tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.m_Data = std::move(value);
+                    cell.m_Sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_Tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-    /// \brief Idempotent. Wait for the task queue complete, make sure add at least one task before waiting, otherwise, it
-    /// return immediately. Do not call it in child thread's context, that is, do not call it in the Task.
-    void WaitForComplete();
+    /// \brief Returns false when the queue is empty.
+    bool TryPop(T& value) {
+        size_t pos = m_Head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = m_Cells[pos & m_Mask];
+            size_t seq = cell.m_Sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (m_Head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.m_Data);
+                    cell.m_Data = T();
+                    cell.m_Sequence.store(pos + m_Mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_Head.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
 private:
-    // Each thread runs this loop.
-    void Loop();
-    AsyncTask(const AsyncTask& self) = delete;
-    AsyncTask(AsyncTask&& self) = delete;
-    AsyncTask& operator=(const AsyncTask& self) = delete;
-    AsyncTask& operator=(AsyncTask&& self) = delete;
+    static size_t RoundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    MpmcQueue(const MpmcQueue& self) = delete;
+    MpmcQueue& operator=(const MpmcQueue& self) = delete;
 
 private:
-    std::condition_variable m_Condition;
-    std::mutex m_Mutex;
-    std::vector<std::thread> m_Threads;
-    // All the following members are protected by Lock.
-    bool m_StopRunning;
-    int m_RunningTasks;
-    std::list<Task> m_TaskQueue;
+    const size_t m_Mask;
+    std::unique_ptr<Cell[]> m_Cells;
+    // Producers and consumers spin on different cache lines.
+    alignas(CACHE_LINE) std::atomic<size_t> m_Tail;
+    alignas(CACHE_LINE) std::atomic<size_t> m_Head;
 };
 
-AsyncTask::AsyncTask(size_t maxthread /*=  std::thread::hardware_concurrency()*/) noexcept : m_StopRunning(false), m_RunningTasks(0) {
-    try {
-        m_Threads.reserve(maxthread);
-        for (decltype(maxthread) i = 0; i < maxthread; ++i) {
-            m_Threads.emplace_back(&AsyncTask::Loop, this);
+// Double-ended ring buffer, not thread safe. The storage is allocated by the first push and doubles when a push finds
+// it full, it is never given back. Pushing and popping move the values in and out of the slots, so a queue that stays
+// within its high-water mark does not allocate. Capacity is rounded up to a power of two.
+template <typename T>
+class RingQueue {
+public:
+    explicit RingQueue(size_t capacity) : m_Mask(RoundUp(capacity) - 1), m_Head(0), m_Size(0) {
+    }
+
+    inline bool Empty() const {
+        return m_Size == 0;
+    }
+
+    inline size_t Size() const {
+        return m_Size;
+    }
+
+    /// \brief Slots allocated so far, 0 before the first push.
+    inline size_t Capacity() const {
+        return m_Slots ? m_Mask + 1 : 0;
+    }
+
+    inline T& Front() {
+        return m_Slots[m_Head];
+    }
+
+    inline T& Back() {
+        return m_Slots[(m_Head + m_Size - 1) & m_Mask];
+    }
+
+    void PushBack(T&& value) {
+        if (!m_Slots) {
+            m_Slots.reset(new T[m_Mask + 1]);
+        } else if (m_Size > m_Mask) {
+            Grow(m_Mask + 2);
         }
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-    } catch (...) {
-        m_StopRunning = true;
+        m_Slots[(m_Head + m_Size) & m_Mask] = std::move(value);
+        ++m_Size;
     }
-}
 
-AsyncTask::~AsyncTask() {
-    WaitForComplete();
-}
+    /// \brief The popped slot is reset, so the value releases what it holds right away.
+    void PopFront() {
+        m_Slots[m_Head] = T();
+        m_Head = (m_Head + 1) & m_Mask;
+        --m_Size;
+    }
 
-void AsyncTask::AddTask(Task&& task) {
-    Lock lock(m_Mutex);
-    if (!m_StopRunning) {
-        m_TaskQueue.emplace_back(task);
+    void PopBack() {
+        Back() = T();
+        --m_Size;
     }
-    lock.unlock();
-    m_Condition.notify_all();
-}
 
-void AsyncTask::Shutdown(bool force) {
-    Lock lock(m_Mutex);
-    m_StopRunning = true;
-    if (force) {
-        // Clear pending task.
-        m_TaskQueue.clear();
+    /// \brief Makes room for count more values with one allocation at most, instead of doubling step by step.
+    void Reserve(size_t count) {
+        if (m_Slots && m_Size + count <= m_Mask + 1) {
+            return;
+        }
+        if (!m_Slots && count <= m_Mask + 1) {
+            m_Slots.reset(new T[m_Mask + 1]);
+            return;
+        }
+        Grow(m_Size + count);
     }
 
-    // Notify all including WaitForComplete.
-    lock.unlock();
-    m_Condition.notify_all();
-}
+    /// \brief The values from front to back. Only contiguous while PopFront was never called, which is how a heap
+    /// kept with std::push_heap and std::pop_heap uses the queue.
+    inline T* Data() {
+        return &m_Slots[m_Head];
+    }
 
-void AsyncTask::Loop() {
-    while (true) {
-        try {
-            Task job;
-            {
-                Lock lock(m_Mutex);
-                m_Condition.wait(lock, [this] { return !m_TaskQueue.empty() || m_StopRunning; });
-                if (m_StopRunning && m_TaskQueue.empty()) {
-                    break;
-                }
-                if (!m_TaskQueue.empty()) {
-                    job = std::move(m_TaskQueue.front());
-                    m_TaskQueue.pop_front();
-                    ++m_RunningTasks;
-                }
-            }
-            if (job) {
-                job();
-            }
-            {
-                Lock lock(m_Mutex);
-                --m_RunningTasks;
-                if (m_TaskQueue.empty() && m_RunningTasks == 0) {
-                    m_StopRunning = true;
-                    lock.unlock();
-                    // No pending tasks and running tasks.
-                    m_Condition.notify_all();
-                }
-            }
-        } catch (...) {
+private:
+    static size_t RoundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
         }
+        return size;
     }
-}
 
-void AsyncTask::WaitForComplete() {
-    {
-        Lock lock(m_Mutex);
-        m_Condition.wait(lock, [this] { return m_TaskQueue.empty() && m_RunningTasks == 0; });
+    // Moves the values to storage of at least capacity slots, doubling the current one at least.
+    void Grow(size_t capacity) {
+        const size_t size = RoundUp(std::max(capacity, (m_Mask + 1) * 2));
+        std::unique_ptr<T[]> slots(new T[size]);
+        for (size_t i = 0; i < m_Size; ++i) {
+            slots[i] = std::move(m_Slots[(m_Head + i) & m_Mask]);
+        }
+        m_Slots = std::move(slots);
+        m_Mask = size - 1;
+        m_Head = 0;
     }
-    // Notify threads to exit by set m_StopRunning with true if no task is added to the pool ^_^.
-    m_StopRunning = true;
-    // Invoke all waiting thread to exit loop.
-    m_Condition.notify_all();
 
-    for (std::thread& thread : m_Threads) {
-        if (thread.joinable()) {
-            thread.join();
+    RingQueue(const RingQueue& self) = delete;
+    RingQueue& operator=(const RingQueue& self) = delete;
+
+private:
+    size_t m_Mask;
+    std::unique_ptr<T[]> m_Slots;
+    size_t m_Head;
+    size_t m_Size;
+};
+
+// Move-only replacement for std::function<void()>. Callables that fit in INLINE_SIZE bytes and can be moved without
+// throwing are constructed in place, so a typical lambda capturing a few pointers or a std::promise costs no allocation;
+// bigger ones fall back to the heap. Move-only captures such as std::unique_ptr are fine since nothing is ever copied.
+class TaskFunction {
+public:
+    static constexpr size_t INLINE_SIZE = 6 * sizeof(void*);
+
+private:
+    struct Ops {
+        void (*Invoke)(void* storage);
+        // Move constructs into dst and destroys src.
+        void (*Relocate)(void* dst, void* src) noexcept;
+        void (*Destroy)(void* storage) noexcept;
+    };
+
+    template <typename F>
+    static constexpr bool IsInline = sizeof(F) <= INLINE_SIZE && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<F>::value;
+
+    template <typename F>
+    struct InlineOps {
+        static void Invoke(void* storage) {
+            (*static_cast<F*>(storage))();
+        }
+        static void Relocate(void* dst, void* src) noexcept {
+            ::new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void Destroy(void* storage) noexcept {
+            static_cast<F*>(storage)->~F();
+        }
+        static constexpr Ops Table = {&Invoke, &Relocate, &Destroy};
+    };
+
+    template <typename F>
+    struct HeapOps {
+        static void Invoke(void* storage) {
+            (**static_cast<F**>(storage))();
+        }
+        static void Relocate(void* dst, void* src) noexcept {
+            *static_cast<F**>(dst) = *static_cast<F**>(src);
         }
+        static void Destroy(void* storage) noexcept {
+            delete *static_cast<F**>(storage);
+        }
+        static constexpr Ops Table = {&Invoke, &Relocate, &Destroy};
+    };
+
+public:
+    TaskFunction() noexcept : m_Ops(nullptr) {
     }
-}
 
-}  // namespace Utils
+    TaskFunction(std::nullptr_t) noexcept : m_Ops(nullptr) {
+    }
 
-namespace AsynTask_T {
+    template <typename Callable, typename F = std::decay_t<Callable>, typename = std::enable_if_t<!std::is_same<F, TaskFunction>::value>>
+    TaskFunction(Callable&& callable) : m_Ops(nullptr) {
+        if constexpr (IsInline<F>) {
+            ::new (static_cast<void*>(m_Storage)) F(std::forward<Callable>(callable));
+            m_Ops = &InlineOps<F>::Table;
+        } else {
+            ::new (static_cast<void*>(m_Storage)) F*(new F(std::forward<Callable>(callable)));
+            m_Ops = &HeapOps<F>::Table;
+        }
+    }
 
-using namespace Utils;
-void Run(std::atomic_int& value) {
-    std::default_random_engine engine(
-        static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()));
-    int random = engine();
-    value += random;
-    std::this_thread::sleep_for(std::chrono::milliseconds(random % 100));
-    value -= random;
-}
+    TaskFunction(TaskFunction&& other) noexcept : m_Ops(other.m_Ops) {
+        if (m_Ops) {
+            m_Ops->Relocate(m_Storage, other.m_Storage);
+            other.m_Ops = nullptr;
+        }
+    }
 
-struct Functor {
-    Functor(std::atomic_int& value) : m_value(value) {
+    TaskFunction& operator=(TaskFunction&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            if (other.m_Ops) {
+                other.m_Ops->Relocate(m_Storage, other.m_Storage);
+                m_Ops = other.m_Ops;
+                other.m_Ops = nullptr;
+            }
+        }
+        return *this;
     }
 
-    Functor(const Functor& f) : m_value(f.m_value) {
+    TaskFunction& operator=(std::nullptr_t) noexcept {
+        Reset();
+        return *this;
     }
 
-    void operator()() {
-        Run(m_value);
+    ~TaskFunction() {
+        Reset();
     }
 
-    void operator()(std::atomic_int& value) {
-        Run(value);
+    inline explicit operator bool() const noexcept {
+        return m_Ops != nullptr;
     }
 
-    void Method() {
-        Run(m_value);
+    inline void operator()() {
+        m_Ops->Invoke(m_Storage);
     }
 
-    void Method(std::atomic_int& value) {
-        Run(value);
+private:
+    void Reset() noexcept {
+        if (m_Ops) {
+            m_Ops->Destroy(m_Storage);
+            m_Ops = nullptr;
+        }
     }
 
+    TaskFunction(const TaskFunction& self) = delete;
+    TaskFunction& operator=(const TaskFunction& self) = delete;
+
 private:
-    std::atomic_int& m_value;
+    alignas(std::max_align_t) unsigned char m_Storage[INLINE_SIZE];
+    const Ops* m_Ops;
 };
 
-void NormalFunc(std::atomic_int& value) {
-    Run(value);
+// Tells the CPU we are in a spin-wait loop, so it does not starve the sibling hyper-thread.
+inline void CpuRelax() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
 }
 
-static std::atomic_int g_value = 0;
-void Function() {
-    Run(g_value);
-}
+class AsyncTask;
 
-// case: Idempotent
-void TCase0() {
-    auto start = std::chrono::system_clock::now();
-    auto sleep_time = 10000;
-    {
-        Utils::AsyncTask at;
-        at.AddTask([sleep_time]() {
-            Function();
-            std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
-            Run(g_value);
-        });
-        at.WaitForComplete();
-        at.WaitForComplete();
-        at.WaitForComplete();
-        at.WaitForComplete();
-    }
-    assert(g_value.load() == 0);
-    auto elapse = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count();
-    assert(elapse >= sleep_time);
-}
+#if defined(__cpp_impl_coroutine)
+class CoTask;
 
-// case: functor
-void TCase1() {
-    std::atomic_int value = 0;
-    {
-        Utils::AsyncTask at;
-        at.AddTask(Functor{value});
+// Resumes a suspended coroutine when run as a task. If the task is dropped instead, by Shutdown(true) for example, the
+// coroutine is destroyed so its frame does not leak.
+class CoroutineResumer {
+public:
+    explicit CoroutineResumer(std::coroutine_handle<> handle) noexcept : m_Handle(handle) {
     }
-    assert(value.load() == 0);
-}
 
-// case: normal function
-void TCase2() {
-    {
-        Utils::AsyncTask at;
-        at.AddTask(Function);
+    CoroutineResumer(CoroutineResumer&& other) noexcept : m_Handle(std::exchange(other.m_Handle, nullptr)) {
     }
-    assert(g_value.load() == 0);
-}
 
-// case: std::bind (deprecated since C++ 17, to be removed)
-void TCase3() {
-    std::atomic_int value = 0;
-    {
-        Utils::AsyncTask at;
-        at.AddTask(std::bind(NormalFunc, std::ref(value)));
-        Functor functor{value};
-        at.AddTask(std::bind(static_cast<void (Functor::*)()>(&Functor::operator()), &functor));
-        at.AddTask(std::bind(static_cast<void (Functor::*)()>(&Functor::Method), &functor));
-        at.AddTask(std::bind(static_cast<void (Functor::*)(std::atomic_int&)>(&Functor::operator()), &functor, std::ref(value)));
-        at.AddTask(std::bind(static_cast<void (Functor::*)(std::atomic_int&)>(&Functor::Method), &functor, std::ref(value)));
+    ~CoroutineResumer() {
+        if (m_Handle) {
+            m_Handle.destroy();
+        }
     }
-    assert(value.load() == 0);
-}
 
-// case: lambda
-void TCase4() {
-    std::atomic_int value = 0;
-    {
-        Utils::AsyncTask at;
-        at.AddTask([&value]() {
-            Functor functor{value};
-            functor.operator()(value);
-        });
+    void operator()() {
+        std::exchange(m_Handle, nullptr).resume();
     }
-    assert(value.load() == 0);
-}
 
-// case: functionality (a little intricate)
-void TCase6() {
-    std::atomic_int value = 0;
-    {
-        auto test_task = [](Utils::AsyncTask& at, std::atomic_int& value, int times) {
-            static auto worker = [](std::atomic_int& value) {
-                Functor functor{value};
-                functor();
-                functor.operator()(value);
-                functor.Method();
-                functor.Method(value);
-                NormalFunc(value);
-                Function();
-            };
+private:
+    CoroutineResumer(const CoroutineResumer& self) = delete;
+    CoroutineResumer& operator=(const CoroutineResumer& self) = delete;
 
-            static auto lambda0 = [&at, &value, times]() { at.AddTask([&at, &value, times]() { worker(value); }); };
+private:
+    std::coroutine_handle<> m_Handle;
+};
+#endif
 
-            static auto lambda1 = [&at, &value, times]() {
-                worker(value);
-                int tmp = times;
-                while (tmp-- > 0) {
-                    at.AddTask(lambda0);
-                }
-                worker(value);
-            };
-            static auto lambda2 = [&at, &value, times]() {
-                worker(value);
+/// A set of tasks submitted to an AsyncTask that is waited for on its own, other work in the pool is not waited for.
+class TaskGroup {
+public:
+    explicit TaskGroup(AsyncTask& pool) noexcept;
+    /// \brief Blocked here by Wait.
+    ~TaskGroup();
+
+    /// \brief Add new task to the group. Can called from Task, including the tasks of this group.
+    void AddTask(TaskFunction&& task);
+
+    /// \brief Idempotent. Wait for the tasks added so far, including those they added to the group while running. The
+    /// caller runs queued tasks of the pool meanwhile, so a task can wait for the subtasks it spawned without deadlock.
+    void Wait();
+
+#if defined(__cpp_impl_coroutine)
+    struct Awaiter {
+        TaskGroup& m_Group;
+        bool await_ready() const;
+        bool await_suspend(std::coroutine_handle<> handle) const;
+        void await_resume() const noexcept {
+        }
+    };
+
+    /// \brief Start a coroutine on the pool, the group counts it until it returns.
+    void Spawn(CoTask&& task);
+
+    /// \brief co_await group suspends the coroutine until the group is empty, then resumes it on a worker.
+    Awaiter operator co_await() noexcept {
+        return Awaiter{*this};
+    }
+#endif
+
+private:
+    friend class AsyncTask;
+#if defined(__cpp_impl_coroutine)
+    friend class CoTask;
+#endif
+    // Called by the pool when tasks of the group are finished or dropped.
+    void Finish(size_t count);
+    TaskGroup(const TaskGroup& self) = delete;
+    TaskGroup& operator=(const TaskGroup& self) = delete;
+
+private:
+    AsyncTask& m_Pool;
+    std::atomic<size_t> m_Pending;
+    // Only Wait blocks on them.
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+#if defined(__cpp_impl_coroutine)
+    // Coroutines awaiting the group, protected by m_Mutex.
+    std::vector<std::coroutine_handle<>> m_Continuations;
+#endif
+};
+
+#if defined(__cpp_impl_coroutine)
+/*  Examples:
+    Utils::CoTask Handle(Utils::AsyncTask& pool, Request request) {
+        co_await pool.Schedule();                               // Now on a worker.
+        co_await pool.SleepFor(std::chrono::milliseconds(10));  // No thread is blocked meanwhile.
+        Utils::TaskGroup group(pool);
+        group.AddTask([](){ ... });
+        co_await group;                                         // Resumed on a worker once the group is empty.
+    }
+
+    Utils::TaskGroup requests(pool);
+    requests.Spawn(Handle(pool, request));
+*/
+/// Return type of coroutines run on an AsyncTask, started by TaskGroup::Spawn. Exceptions escaping the coroutine are
+/// swallowed like those of plain tasks.
+class CoTask {
+public:
+    struct promise_type {
+        TaskGroup* m_Group = nullptr;
+
+        // The frame is destroyed when the coroutine returns, or when a resumption is dropped by the pool.
+        ~promise_type() {
+            if (m_Group) {
+                m_Group->Finish(1);
+            }
+        }
+
+        CoTask get_return_object() noexcept {
+            return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {
+        }
+
+        void unhandled_exception() noexcept {
+        }
+    };
+
+    CoTask(CoTask&& other) noexcept : m_Handle(std::exchange(other.m_Handle, nullptr)) {
+    }
+
+    /// \brief A coroutine that was never spawned is destroyed without running.
+    ~CoTask() {
+        if (m_Handle) {
+            m_Handle.destroy();
+        }
+    }
+
+private:
+    friend class TaskGroup;
+    explicit CoTask(std::coroutine_handle<promise_type> handle) noexcept : m_Handle(handle) {
+    }
+    CoTask(const CoTask& self) = delete;
+    CoTask& operator=(const CoTask& self) = delete;
+
+private:
+    std::coroutine_handle<promise_type> m_Handle;
+};
+#endif
+
+/*  Examples:
+    {
+        Utils::AsyncTask pool;
+        for (...) {
+            // Thousands of batches on the same threads.
+            Utils::TaskGroup group(pool);
+            group.AddTask([](){
+                //do something.
+            });
+            group.Wait();
+        }
+    }
+
+    {
+        AsyncTaskHelper ath;
+        ath.AddTask([&ath](){
+            // do something.
+            ath.AddTask([](){
+                //do something.
+            });
+        });
+        ath.AddTask(std::bind(...));
+        ath.WaitForComplete(); // WaitForComplete can be called many times.
+    } // Blocked here by WaitForComplete in dtor.
+*/
+/// Long-lived thread pool. The threads stay until the pool is destroyed, use TaskGroup or WaitForComplete to wait for
+/// a batch of tasks.
+class AsyncTask {
+private:
+    using Task = TaskFunction;
+    using Lock = std::unique_lock<std::mutex>;
+
+    // A queued task and the group it was submitted to, if any.
+    struct Job {
+        Task m_Task;
+        TaskGroup* m_Group = nullptr;
+#if ASYNCTASK_STATS
+        // When the job was queued.
+        std::chrono::steady_clock::time_point m_Queued{};
+#endif
+#if ASYNCTASK_TRACE
+        // Trace id, 0 when the job was queued while not tracing, the id of the task that queued it and its label.
+        uint64_t m_TraceId = 0;
+        uint64_t m_TraceParent = 0;
+        const char* m_TraceLabel = nullptr;
+#endif
+    };
+
+    static constexpr size_t HISTOGRAM_BUCKETS = 32;
+
+#if ASYNCTASK_STATS
+    // Counters of one thread. A worker adds to its own with a relaxed load and store, so counting costs no locked
+    // instruction. The threads outside the pool share one set and use fetch_add. Stats() reads them at any time.
+    struct Counters {
+        bool m_Shared = false;
+        std::atomic<uint64_t> m_Executed{0};
+        std::atomic<uint64_t> m_WaitNanos{0};
+        std::atomic<uint64_t> m_RunNanos{0};
+        std::atomic<uint64_t> m_IdleNanos{0};
+        std::atomic<uint64_t> m_ParkNanos{0};
+        std::atomic<uint64_t> m_Parks{0};
+        std::atomic<uint64_t> m_Steals{0};
+        std::atomic<uint64_t> m_Contended{0};
+        std::atomic<uint64_t> m_WaitHistogram[HISTOGRAM_BUCKETS] = {};
+        std::atomic<uint64_t> m_RunHistogram[HISTOGRAM_BUCKETS] = {};
+
+        void Add(std::atomic<uint64_t>& counter, uint64_t value) {
+            if (m_Shared) {
+                counter.fetch_add(value, std::memory_order_relaxed);
+            } else {
+                counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            }
+        }
+    };
+#endif
+
+#if ASYNCTASK_TRACE
+    static constexpr size_t TRACE_EVENTS = 8192;
+    static constexpr size_t NO_WORKER = SIZE_MAX;
+    enum TraceType : uint8_t { TRACE_SUBMIT, TRACE_START, TRACE_END };
+
+    // One recorded event. The fields are relaxed atomics, plain stores for the writer, so that WriteTrace can read a
+    // ring while its thread keeps writing.
+    struct TraceEvent {
+        std::atomic<uint64_t> m_Time{0};
+        std::atomic<uint64_t> m_Id{0};
+        std::atomic<uint64_t> m_Parent{0};
+        std::atomic<const char*> m_Label{nullptr};
+        std::atomic<const AsyncTask*> m_Pool{nullptr};
+        std::atomic<size_t> m_Worker{NO_WORKER};
+        std::atomic<uint8_t> m_Type{TRACE_SUBMIT};
+    };
+
+    // The last TRACE_EVENTS events of a thread, older ones are overwritten. Allocated the first time the thread records
+    // an event, and handed over to another thread once it exits, so a churning pool reuses the same few rings.
+    struct TraceRing {
+        TraceEvent m_Events[TRACE_EVENTS];
+        // Events written so far, only the writing thread stores it.
+        std::atomic<uint64_t> m_Head{0};
+        // Position in the registry, tells apart the threads outside the pool in the trace and the ids they hand out.
+        size_t m_Serial = 0;
+        uint64_t m_NextId = 0;
+        // Protected by the registry mutex.
+        bool m_Owned = false;
+    };
+
+    struct TraceRegistry {
+        std::mutex m_Mutex;
+        std::vector<std::unique_ptr<TraceRing>> m_Rings;
+    };
+
+    // Gives the ring of the thread back to the registry when the thread exits.
+    struct TraceOwner {
+        TraceRing* m_Ring = nullptr;
+        ~TraceOwner();
+    };
+#endif
+
+    // A delayed or periodic task. m_Next links it into the timer inbox or into a wheel slot, never both.
+    struct TimerNode {
+        enum State { WAITING, FIRED, CANCELLED };
+        Task m_Task;
+        uint64_t m_DueTick = 0;
+        // Zero for a delayed task.
+        uint64_t m_PeriodTicks = 0;
+        std::atomic<int> m_State{WAITING};
+        TimerNode* m_Next = nullptr;
+        // Keeps the node alive while it is in the inbox, in the wheel or running, handles only hold a weak reference.
+        std::shared_ptr<TimerNode> m_Self;
+    };
+
+    // A job waiting in a lane. m_Due orders the lane: the deadline, or the time a HIGH or LOW job was added.
+    struct LaneJob {
+        Job m_Job;
+        std::chrono::steady_clock::time_point m_Due;
+    };
+
+    // Queue of the tasks added with a priority or a deadline.
+    struct Lane {
+        std::mutex m_Mutex;
+        // FIFO for the HIGH and LOW lanes, where m_Due grows with the position. Min-heap on m_Due for the deadline lane.
+        RingQueue<LaneJob> m_Jobs{LANE_CAPACITY};
+        // m_Due of the front job, lets the workers pick a lane without locking them all. Written with m_Mutex held.
+        std::atomic<std::chrono::steady_clock::rep> m_FrontDue{std::chrono::steady_clock::rep(0)};
+        std::atomic<size_t> m_Size{0};
+    };
+
+    struct Worker {
+        // Task deque owned by this worker. The owner pushes and pops at the back (LIFO, keeps caches warm on nested
+        // fan-out), idle workers steal from the front (FIFO, takes the oldest and usually the largest piece of work).
+        // Allocated by the first job queued to the slot, so idle slots cost nothing.
+        std::mutex m_QueueMutex;
+        RingQueue<Job> m_Jobs{WORKER_QUEUE_CAPACITY};
+        // Parking slot. A submitter claims a parked worker by clearing m_Parked, then sets m_Signaled to wake it.
+        std::atomic<bool> m_Parked{false};
+        std::mutex m_ParkMutex;
+        std::condition_variable m_ParkCondition;
+        bool m_Signaled = false;
+        // The thread serving this slot, protected by Lock. Slots are allocated up front and get a thread on demand.
+        std::thread m_Thread;
+        // Written with Lock held, SubmitBatch reads it without.
+        std::atomic<bool> m_Alive{false};
+        size_t m_Index = 0;
+        // Depth of the BlockingRegions the running task is in, only touched by the worker's thread.
+        size_t m_Blocking = 0;
+        // HIGH and deadline tasks run in a row, only touched by the worker's thread.
+        size_t m_UrgentRun = 0;
+        // Placement, fixed at construction. m_Cpu is -1 when the worker is not pinned.
+        size_t m_Node = 0;
+        int m_Cpu = -1;
+        // Steal order when the pool is NUMA aware, the workers of the same node first.
+        std::vector<size_t> m_Victims;
+#if ASYNCTASK_STATS
+        Counters m_Counters;
+#endif
+    };
+
+public:
+    static constexpr size_t DEFAULT_SPIN_COUNT = 64;
+
+    /// Sizing policy of the pool.
+    struct Policy {
+        // Threads started by the constructor and never retired.
+        size_t minthread = 0;
+        // Upper bound of threads, more are started when a task is added while all the running ones are busy.
+        size_t maxthread = std::thread::hardware_concurrency();
+        // The number of times an idle worker scans the queues before it parks, 0 parks right away.
+        size_t spincount = DEFAULT_SPIN_COUNT;
+        // A thread above minthread that stays parked this long exits.
+        std::chrono::milliseconds idletimeout = std::chrono::seconds(10);
+        // A LOW task queued this long runs before the HIGH and deadline tasks, so a steady flow of them can not starve it.
+        std::chrono::milliseconds agelimit = std::chrono::milliseconds(100);
+        // A deadline task runs before the normal ones once its deadline is this close. Until then it waits for the
+        // normal queues to run empty, so a far deadline does not jump ahead of work that is due now.
+        std::chrono::milliseconds deadlinewindow = std::chrono::milliseconds(100);
+        // Pending tasks, queued and running, past which a thread outside the pool waits to add one, 0 for no limit. Tasks
+        // added by the pool's own tasks are never held back, they are what makes room.
+        size_t capacity = 0;
+        // Pin every worker to one CPU. Workers are spread over the NUMA nodes in turn, then over the CPUs of a node.
+        bool pinning = false;
+        // Keep the workers on the CPUs of their NUMA node, give every node its own queue for AddTaskToNode, and steal
+        // from the same node first. Only supported on Linux, where the topology is read from /sys/devices/system/node.
+        // Without it, or with a single node, the pool behaves as usual.
+        bool numa = false;
+        // Threads started on top of maxthread while tasks are in a BlockingRegion, each runs for one blocked task and
+        // exits once the blocking is over. 0 turns compensation off.
+        size_t maxblocking = 8;
+    };
+
+    /// Result of adding a task without waiting for room indefinitely.
+    enum class Status {
+        OK,
+        // Policy::capacity was reached, the task is left untouched.
+        FULL,
+        // The pool is shut down, the task is left untouched.
+        STOPPED
+    };
+
+    /// Dispatch order of a task. HIGH tasks run before the normal ones, LOW tasks only once nothing else is queued or
+    /// they waited for longer than Policy::agelimit. A worker that ran URGENT_BURST HIGH or deadline tasks in a row
+    /// takes a normal one next, so a flood of them slows the normal tasks down but can not starve them.
+    enum class Priority { HIGH, NORMAL, LOW };
+
+    /// \brief Constructor, threads are started lazily, up to maxthread.
+    /// Parameters:
+    ///     maxthread: the number of threads in the threadpool, default value of the number of processors is not optimal.
+    ///     spincount: the number of times an idle worker scans the queues before it parks, 0 parks right away.
+    AsyncTask(size_t maxthread = std::thread::hardware_concurrency(), size_t spincount = DEFAULT_SPIN_COUNT) noexcept;
+    /// \brief Constructor, only the policy's minthread threads are started here.
+    explicit AsyncTask(const Policy& policy) noexcept;
+    ~AsyncTask();
+
+    inline size_t MaxConcurrency() {
+        return m_MaxThreads;
+    }
+
+    /// \brief The number of NUMA nodes the pool spreads its workers and queues over, 1 unless Policy::numa is set.
+    inline size_t NodeCount() const {
+        return m_NodeQueues.empty() ? 1 : m_NodeQueues.size();
+    }
+
+    /// \brief The number of threads currently running, between minthread and maxthread, plus the compensating ones.
+    inline size_t ThreadCount() {
+        return m_AliveThreads;
+    }
+
+    inline explicit operator bool() {
+        return !m_StopRunning;
+    }
+
+    /// \brief Add new task to queue. Can called from Task, in which case the task goes to the calling worker's own
+    /// queue without touching the shared one, and without allocating once the queue reached its high-water mark. Other
+    /// threads publish to a lock-free ring, the mutex is only taken when the ring is full. Wakes at most one parked
+    /// worker. Blocks while Policy::capacity is reached, the task is dropped if the pool is shut down.
+    void AddTask(Task&& task);
+
+    /// \brief Same as AddTask(task), but waits at most timeout for room.
+    Status AddTask(Task&& task, std::chrono::milliseconds timeout);
+
+    /// \brief Same as AddTask(task), but returns Status::FULL right away if there is no room.
+    Status TryAddTask(Task&& task);
+
+    /// \brief Add new task for the workers of the given NUMA node, taken modulo NodeCount(). They pick it before
+    /// anything queued for the other nodes, which only get it once they run out of work. Same as AddTask(task) unless
+    /// Policy::numa is set.
+    void AddTaskToNode(size_t node, Task&& task);
+
+    /// \brief Add new task to the given group, see TaskGroup::AddTask.
+    void AddTask(TaskGroup& group, Task&& task);
+
+    /// \brief Add the tasks of [first, last), moved from, as one batch: the pending count is updated once, the batch is
+    /// split into contiguous runs over the worker queues with one lock each, and min(N, parked) workers are woken.
+    /// Called from Task, the batch goes to the calling worker's own queue and the woken workers steal from it.
+    template <typename Iterator>
+    void AddTasks(Iterator first, Iterator last) {
+        std::vector<Job> jobs;
+        jobs.reserve(static_cast<size_t>(std::distance(first, last)));
+        for (; first != last; ++first) {
+            jobs.emplace_back(Job{Task(std::move(*first)), nullptr});
+        }
+        SubmitBatch(jobs);
+    }
+
+    /// \brief Add count tasks made by generator(i), i from 0 to count - 1, as one batch, see AddTasks(first, last).
+    template <typename Generator>
+    void AddTasks(size_t count, Generator&& generator) {
+        std::vector<Job> jobs;
+        jobs.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            jobs.emplace_back(Job{Task(generator(i)), nullptr});
+        }
+        SubmitBatch(jobs);
+    }
+
+    /// \brief Add a batch of tasks to the given group, see AddTasks(first, last).
+    template <typename Iterator>
+    void AddTasks(TaskGroup& group, Iterator first, Iterator last);
+
+    /// \brief Add a batch of generated tasks to the given group, see AddTasks(count, generator).
+    template <typename Generator>
+    void AddTasks(TaskGroup& group, size_t count, Generator&& generator);
+
+    /// \brief Add new task with the given priority, NORMAL is the same as AddTask(task). Every priority has its own
+    /// queue, a HIGH task never waits behind the queued normal or LOW ones.
+    void AddTask(Priority priority, Task&& task);
+
+    /// \brief Add new task to run earliest deadline first. Deadline tasks within Policy::deadlinewindow run before the
+    /// normal ones, ordered together with the HIGH tasks whose deadline is the time they were added. Further ones run
+    /// once the normal queues are empty, or once they come within the window. A missed deadline does not drop the task.
+    void AddTask(std::chrono::steady_clock::time_point deadline, Task&& task);
+
+    /// \brief Shut down task queue. Can called from any thread. The threads exit once the pending work is done.
+    /// Parameters:
+    ///     force:  true, forbid adding new task and clear pending tasks, waiting for running task.
+    ///             false, forbid adding new task and waiting for running task and pending task.
+    void Shutdown(bool force = false);
+
+    /// \brief Idempotent. Wait until all the tasks of the pool are finished, whatever group they belong to. The threads keep
+    /// running, so more tasks can be added afterwards. The caller runs queued tasks meanwhile. Called from a Task, it
+    /// waits for all the other tasks except those blocked in WaitForComplete themselves.
+    void WaitForComplete();
+
+    /// \brief Runs one queued task on the calling thread. Returns false if there was none.
+    bool RunPendingTask();
+
+    /// Snapshot returned by Stats(). Times are sums over the tasks, or over the idle periods of the threads.
+    struct Statistics {
+        struct Thread {
+            uint64_t executed = 0;
+            // Tasks taken from the queue of another worker.
+            uint64_t steals = 0;
+            uint64_t parks = 0;
+            // Queue locks found held by another thread.
+            uint64_t contended = 0;
+            // From AddTask until the task started.
+            std::chrono::nanoseconds wait{0};
+            std::chrono::nanoseconds run{0};
+            // Looking for work before parking, then parked.
+            std::chrono::nanoseconds idle{0};
+            std::chrono::nanoseconds parked{0};
+        };
+
+        // One entry per worker slot, then one for the threads outside the pool that ran tasks while waiting.
+        std::vector<Thread> threads;
+        Thread total;
+        // Entry i counts the tasks that waited, or ran, for [2^i, 2^(i+1)) nanoseconds, the last one the longer ones too.
+        std::array<uint64_t, HISTOGRAM_BUCKETS> wait_histogram{};
+        std::array<uint64_t, HISTOGRAM_BUCKETS> run_histogram{};
+        // Gauges at the time of the snapshot.
+        size_t pending = 0;
+        size_t alive = 0;
+        size_t sleeping = 0;
+        // Job slots allocated by the queue of each worker slot, they only grow.
+        std::vector<size_t> queue_slots;
+
+        /// \brief Upper bound of the bucket reached by the given fraction of the histogram, 0.99 for the p99.
+        static std::chrono::nanoseconds Percentile(const std::array<uint64_t, HISTOGRAM_BUCKETS>& histogram, double fraction);
+    };
+
+    /// \brief Sums the counters of all the threads on demand. The counters keep changing meanwhile, so the snapshot is
+    /// not atomic as a whole. Only the gauges are filled when compiled with ASYNCTASK_STATS 0.
+    Statistics Stats() const;
+
+    /// \brief Starts recording when each task of this pool is submitted, starts and ends, on which thread and from which
+    /// task. Every thread records into a ring of its own, no lock is taken and nothing is allocated per event.
+    void StartTrace();
+
+    /// \brief Stops recording, the recorded events are kept for WriteTrace.
+    void StopTrace();
+
+    /// \brief Writes the recorded events of this pool as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev. Each
+    /// task is a slice on the thread that ran it, with a flow arrow from where it was submitted. Writes an empty trace
+    /// when compiled with ASYNCTASK_TRACE 0.
+    void WriteTrace(std::ostream& out) const;
+
+    /// Names in the trace the tasks submitted from the current thread while in scope. label is kept as a pointer, so
+    /// it has to outlive the trace, a string literal usually.
+    class TraceLabel {
+    public:
+        explicit TraceLabel(const char* label);
+        ~TraceLabel();
+
+        TraceLabel(const TraceLabel&) = delete;
+        TraceLabel& operator=(const TraceLabel&) = delete;
+
+    private:
+        const char* m_Previous;
+    };
+
+    /// Scope in which the running task blocks, on I/O, a lock or a sleep. While a worker of a pool is inside, the pool
+    /// may run one more thread so the queued work keeps all of maxthread busy, see Policy::maxblocking. Nested regions
+    /// count once. Does nothing outside the tasks of a pool.
+    class BlockingRegion {
+    public:
+        BlockingRegion() noexcept;
+        ~BlockingRegion();
+
+    private:
+        BlockingRegion(const BlockingRegion& self) = delete;
+        BlockingRegion& operator=(const BlockingRegion& self) = delete;
+
+    private:
+        AsyncTask* m_Pool;
+    };
+
+    /// \brief Calls function inside a BlockingRegion and returns its result.
+    template <typename Function>
+    static auto MarkBlocking(Function&& function) -> decltype(function()) {
+        BlockingRegion region;
+        return function();
+    }
+
+    /// Refers to a delayed or periodic task, a default constructed handle refers to none.
+    class TimerHandle {
+    public:
+        /// \brief Cancels the task if it has not run yet, or the further runs of a periodic task. O(1), the entry is
+        /// dropped when the timer thread reaches it. Returns false if the task already ran or was cancelled.
+        bool Cancel();
+
+    private:
+        friend class AsyncTask;
+        std::weak_ptr<TimerNode> m_Node;
+    };
+
+    /// \brief Queues task once delay has passed, with a resolution of one millisecond. Delayed tasks are not pending
+    /// until then, WaitForComplete does not wait for them and they are dropped when the pool is destroyed.
+    TimerHandle AddDelayedTask(std::chrono::milliseconds delay, Task&& task);
+
+    /// \brief Queues task every period, the first time one period from now. A run is queued only after the previous one
+    /// returned, missed periods are skipped rather than queued back to back.
+    TimerHandle AddPeriodicTask(std::chrono::milliseconds period, Task&& task);
+
+#if defined(__cpp_impl_coroutine)
+    struct ScheduleAwaiter {
+        AsyncTask& m_Pool;
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) const {
+            m_Pool.AddTask(CoroutineResumer(handle));
+        }
+        void await_resume() const noexcept {
+        }
+    };
+
+    struct SleepAwaiter {
+        AsyncTask& m_Pool;
+        std::chrono::steady_clock::time_point m_Due;
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) const {
+            m_Pool.AddDelayed(m_Due, std::chrono::milliseconds(0), CoroutineResumer(handle));
+        }
+        void await_resume() const noexcept {
+        }
+    };
+
+    /// \brief co_await pool.Schedule() resumes the coroutine on a worker of the pool.
+    ScheduleAwaiter Schedule() noexcept {
+        return ScheduleAwaiter{*this};
+    }
+
+    /// \brief co_await pool.SleepFor(duration) resumes the coroutine on a worker once duration has passed, no thread is
+    /// blocked meanwhile.
+    template <typename Rep, typename Period>
+    SleepAwaiter SleepFor(const std::chrono::duration<Rep, Period>& duration) {
+        return SleepAwaiter{*this, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration)};
+    }
+#endif
+
+private:
+    // Queues job, waiting for room until the given time. job is left untouched unless Status::OK is returned.
+    // node is a NUMA node hint, NO_NODE for none.
+    Status Submit(Job& job, std::chrono::steady_clock::time_point until = std::chrono::steady_clock::time_point::max(), size_t node = NO_NODE);
+    // Queues all the jobs at once, see AddTasks. jobs is left with moved from jobs.
+    void SubmitBatch(std::vector<Job>& jobs);
+    // Moves jobs[begin, end) to the worker's queue, called with its m_QueueMutex held.
+    void PushJobs(Worker& worker, std::vector<Job>& jobs, size_t begin, size_t end);
+    // Counts one more pending task against Policy::capacity.
+    Status Admit(std::chrono::steady_clock::time_point until);
+    // Queues task past Policy::capacity, for the work the pool has accepted already.
+    void Post(Task&& task);
+    // Each thread runs this loop.
+    void Loop(size_t index);
+    void Execute(Job& job);
+    // Runs queued tasks until done() holds, done() is checked with mutex locked and condition notified when it changes.
+    template <typename Predicate>
+    void HelpUntil(std::mutex& mutex, std::condition_variable& condition, Predicate done);
+    // Pop from the own queue, then the shared queue, then steal from the other workers.
+    bool FindTask(size_t index, Job& job);
+    bool PopShared(Job& job);
+    void PushLane(size_t lane, std::chrono::steady_clock::time_point due, Job&& job);
+    bool PopLane(size_t lane, Job& job);
+    // An aged LOW job, else the earliest of the HIGH and deadline lanes. Looked at before any other queue.
+    bool PopUrgent(Job& job);
+    bool Steal(size_t index, Job& job);
+    bool StealFrom(Worker& victim, Job& job);
+    // Locks the queue of worker, counting the times it was held by somebody else.
+    Lock LockQueue(Worker& worker);
+#if ASYNCTASK_STATS
+    // The counters of the calling thread: its worker's, or the shared ones of the threads outside the pool.
+    Counters& CurrentCounters();
+    static size_t Bucket(uint64_t nanos);
+#endif
+    // Records that job is being queued, for the statistics and the trace.
+    void Stamp(Job& job);
+    void Stamp(std::vector<Job>& jobs);
+#if ASYNCTASK_TRACE
+    void Record(TraceType type, const Job& job);
+    static TraceRing& CurrentTraceRing();
+    static TraceRegistry& Registry();
+    static uint64_t TraceClock();
+#endif
+    // Pops from the node queues, starting after first.
+    bool PopNodes(size_t first, Job& job);
+    // The CPUs of every NUMA node the process may run on. A single node when the system does not tell, whose CPU list
+    // is empty where affinity is not supported.
+    static std::vector<std::vector<int>> ReadTopology();
+    // Parses a list such as "0-3,8,10-11".
+    static std::vector<int> ParseCpuList(const std::string& list);
+    // Spreads the workers over the nodes and builds the node queues, called by the constructor.
+    void Place();
+    // Applies the placement of the calling worker, failures leave it where the system put it.
+    void Bind(const Worker& worker);
+    // Blocks in the worker's parking slot until a submitter picks it, the idle timeout retires it or the pool can exit.
+    // Returns false to exit.
+    bool Park(size_t index, Job& job);
+    // Last look for work before a timed out worker exits, returns false to exit.
+    bool Retire(size_t index, Job& job);
+    // Whether the worker may exit.
+    bool CanExit() const;
+    // Called when a task is finished or dropped.
+    void FinishTasks(size_t count);
+    void FinishJob(Job& job);
+    // Hands a wakeup to one parked worker, returns false if nobody is parked.
+    bool WakeOne(size_t node = NO_NODE);
+    // Claims a parked worker and signals it.
+    bool Unpark(Worker& worker);
+    void WakeAll();
+    // Starts up to count more threads, less the workers spinning to pick up the new tasks.
+    void MaybeSpawn(size_t count = 1);
+    // Wakes or starts a thread if more tasks are pending than the busy threads run.
+    void HandOff();
+    // Starts a thread in a free slot unless ThreadLimit is reached, called with Lock held.
+    bool SpawnLocked();
+    // maxthread plus the compensation for the workers in a BlockingRegion.
+    size_t ThreadLimit() const;
+    // Called by the outermost BlockingRegion of a worker.
+    void EnterBlocking();
+    void LeaveBlocking();
+    // Exits a worker above ThreadLimit whose own queue is empty, returns false to go on.
+    bool RetireExcess(size_t index);
+    // Queues task once due has passed, then every period if it is not zero.
+    TimerHandle AddDelayed(std::chrono::steady_clock::time_point due, std::chrono::milliseconds period, Task&& task);
+    // The first wheel tick at or after time.
+    uint64_t TickOf(std::chrono::steady_clock::time_point time) const;
+    // Hands node to the timer thread through the lock-free inbox.
+    void PushTimer(TimerNode* node);
+    // The timer thread runs this loop, it is started with the first delayed task. Only this thread touches the wheel.
+    void TimerLoop();
+    // Files node into the slot it is due in, or queues it if it is due already.
+    void InsertTimer(TimerNode* node);
+    // Moves the slots of the higher levels that start at m_WheelTick one level down, then fires the level 0 slot.
+    void AdvanceWheel();
+    // The next tick with something to do, UINT64_MAX if the wheel is empty.
+    uint64_t NextWheelEvent() const;
+    void FireTimer(TimerNode* node);
+    void RunPeriodic(std::shared_ptr<TimerNode> node);
+    static void ReleaseTimer(TimerNode* node);
+    // Stops and joins the timer thread.
+    void StopTimer();
+    // Drops the remaining delayed tasks, called once no other thread can touch the timers.
+    void ClearTimers();
+    AsyncTask(const AsyncTask& self) = delete;
+    AsyncTask(AsyncTask&& self) = delete;
+    AsyncTask& operator=(const AsyncTask& self) = delete;
+    AsyncTask& operator=(AsyncTask&& self) = delete;
+
+private:
+    friend class TaskGroup;
+
+    static constexpr size_t SHARED_QUEUE_CAPACITY = 4096;
+    static constexpr size_t NODE_QUEUE_CAPACITY = 1024;
+    // Initial capacity of the worker and lane queues, they grow from there.
+    static constexpr size_t WORKER_QUEUE_CAPACITY = 256;
+    static constexpr size_t LANE_CAPACITY = 256;
+    static constexpr size_t NO_NODE = SIZE_MAX;
+    enum { HIGH_LANE, DEADLINE_LANE, LOW_LANE, LANE_COUNT };
+    // A helping waiter that found nothing to run looks again after this long, doubling up to the maximum.
+    static constexpr std::chrono::microseconds HELP_BACKOFF_MIN = std::chrono::microseconds(50);
+    static constexpr std::chrono::microseconds HELP_BACKOFF_MAX = std::chrono::milliseconds(8);
+    // Urgent tasks a worker runs in a row before it gives a normal task its turn.
+    static constexpr size_t URGENT_BURST = 8;
+
+    // The pool and the worker running on the current thread, null for non-worker threads.
+    static thread_local AsyncTask* s_CurrentPool;
+    static thread_local Worker* s_CurrentWorker;
+    // The pool whose task the current thread is running, workers and helping waiters alike.
+    static thread_local AsyncTask* s_ExecutingPool;
+#if ASYNCTASK_TRACE
+    static thread_local TraceOwner s_TraceOwner;
+    // Trace id of the task running on the current thread and the label of the tasks it submits.
+    static thread_local uint64_t s_TraceTask;
+    static thread_local const char* s_TraceLabel;
+#endif
+
+    const Policy m_Policy;
+    const size_t m_MaxThreads;
+    // Only WaitForComplete waits on it, workers park in their own slot.
+    std::condition_variable m_Condition;
+    std::mutex m_Mutex;
+    std::vector<std::unique_ptr<Worker>> m_Workers;
+    // Queued and running tasks.
+    std::atomic<size_t> m_PendingTasks;
+    // Tasks blocked in WaitForComplete, they are still counted by m_PendingTasks.
+    std::atomic<size_t> m_WaitingTasks;
+    // Number of parked workers, submitters skip the slot scan when nobody is parked.
+    std::atomic<size_t> m_Sleepers;
+    // Workers inside a BlockingRegion.
+    std::atomic<size_t> m_Blocked;
+    // Workers looking for work before parking, and timed out ones taking a last look before exiting. A submitter only
+    // starts a thread when it sees neither, see MaybeSpawn.
+    std::atomic<size_t> m_Spinning;
+    std::atomic<size_t> m_Retiring;
+    // Written with Lock held.
+    std::atomic<size_t> m_AliveThreads;
+    // Where the next slot scan starts, spreads wakeups over the workers.
+    std::atomic<size_t> m_WakeCursor;
+    // Written with Lock held.
+    std::atomic<bool> m_StopRunning;
+    // Submissions from non-worker threads.
+    MpmcQueue<Job> m_SharedQueue;
+    // Size of m_TaskQueue, lets workers skip the lock when nothing has overflowed.
+    std::atomic<size_t> m_OverflowTasks;
+    Lane m_Lanes[LANE_COUNT];
+    // Set up by the constructor when Policy::numa finds more than one node, empty otherwise.
+    std::vector<std::vector<int>> m_NodeCpus;
+    std::vector<std::unique_ptr<MpmcQueue<Job>>> m_NodeQueues;
+    std::vector<std::vector<size_t>> m_NodeWorkers;
+    // Jobs in all the lanes, the only cost of the lanes for the workers while they are unused.
+    std::atomic<size_t> m_LaneTasks;
+#if ASYNCTASK_STATS
+    Counters m_ExternalCounters;
+#endif
+#if ASYNCTASK_TRACE
+    std::atomic<bool> m_Tracing{false};
+#endif
+    // All the following members are protected by Lock.
+    // Takes the submissions that do not fit into m_SharedQueue.
+    std::list<Job> m_TaskQueue;
+    // Set by a submitter that found no free slot while a worker was retiring, that worker stays instead.
+    bool m_SpawnRequested;
+    // Submitters waiting for room, FinishTasks only takes m_SpaceMutex when there are some.
+    std::atomic<size_t> m_BlockedSubmitters;
+    std::mutex m_SpaceMutex;
+    std::condition_variable m_SpaceCondition;
+    // Timer wheel, WHEEL_LEVELS levels of WHEEL_SLOTS slots, a slot of level n spans WHEEL_SLOTS^n ticks of one
+    // millisecond. Inserting and cancelling are O(1), each timer moves down at most WHEEL_LEVELS - 1 times.
+    static constexpr size_t WHEEL_BITS = 6;
+    static constexpr size_t WHEEL_SLOTS = size_t(1) << WHEEL_BITS;
+    static constexpr size_t WHEEL_LEVELS = 4;
+    const std::chrono::steady_clock::time_point m_TimerEpoch;
+    // Nodes pushed by other threads, drained by the timer thread.
+    std::atomic<TimerNode*> m_TimerInbox;
+    // The tick the timer thread sleeps until, a submitter due earlier wakes it.
+    std::atomic<uint64_t> m_TimerWake;
+    std::atomic<bool> m_TimerStop;
+    // Set once m_TimerThread is started, with m_TimerMutex held.
+    std::atomic<bool> m_TimerStarted;
+    // Owned by the timer thread.
+    TimerNode* m_Wheel[WHEEL_LEVELS][WHEEL_SLOTS] = {};
+    uint64_t m_WheelTick = 0;
+    size_t m_WheelCount = 0;
+    // Only used to start the timer thread and to let it sleep.
+    std::mutex m_TimerMutex;
+    std::condition_variable m_TimerCondition;
+    std::thread m_TimerThread;
+};
+
+thread_local AsyncTask* AsyncTask::s_CurrentPool = nullptr;
+thread_local AsyncTask::Worker* AsyncTask::s_CurrentWorker = nullptr;
+thread_local AsyncTask* AsyncTask::s_ExecutingPool = nullptr;
+#if ASYNCTASK_TRACE
+thread_local AsyncTask::TraceOwner AsyncTask::s_TraceOwner;
+thread_local uint64_t AsyncTask::s_TraceTask = 0;
+thread_local const char* AsyncTask::s_TraceLabel = nullptr;
+#endif
+
+AsyncTask::AsyncTask(size_t maxthread /*=  std::thread::hardware_concurrency()*/, size_t spincount /*= DEFAULT_SPIN_COUNT*/) noexcept
+    : AsyncTask(Policy{0, maxthread, spincount}) {
+}
+
+AsyncTask::AsyncTask(const Policy& policy) noexcept
+    : m_Policy(policy),
+      m_MaxThreads(std::max<size_t>(policy.maxthread, 1)),
+      m_PendingTasks(0),
+      m_WaitingTasks(0),
+      m_Sleepers(0),
+      m_Blocked(0),
+      m_Spinning(0),
+      m_Retiring(0),
+      m_AliveThreads(0),
+      m_WakeCursor(0),
+      m_StopRunning(false),
+      m_SharedQueue(SHARED_QUEUE_CAPACITY),
+      m_OverflowTasks(0),
+      m_LaneTasks(0),
+      m_SpawnRequested(false),
+      m_BlockedSubmitters(0),
+      m_TimerEpoch(std::chrono::steady_clock::now()),
+      m_TimerInbox(nullptr),
+      m_TimerWake(UINT64_MAX),
+      m_TimerStop(false),
+      m_TimerStarted(false) {
+    try {
+        // Slots are created before any thread starts, so the workers can steal without synchronizing on the vector. The
+        // slots past m_MaxThreads are for compensating threads.
+        const size_t slots = m_MaxThreads + m_Policy.maxblocking;
+        m_Workers.reserve(slots);
+        for (size_t i = 0; i < slots; ++i) {
+            m_Workers.emplace_back(std::make_unique<Worker>());
+            m_Workers.back()->m_Index = i;
+        }
+        Place();
+#if ASYNCTASK_STATS
+        m_ExternalCounters.m_Shared = true;
+#endif
+        Lock lock(m_Mutex);
+        for (size_t i = 0; i < std::min(m_Policy.minthread, m_MaxThreads); ++i) {
+            SpawnLocked();
+        }
+    } catch (...) {
+        m_StopRunning = true;
+    }
+}
+
+AsyncTask::~AsyncTask() {
+    WaitForComplete();
+    // Dropped delayed tasks may finish groups and coroutines, which still can queue work here.
+    StopTimer();
+    ClearTimers();
+    Shutdown();
+    // No thread is started once m_StopRunning is set.
+    for (auto& worker : m_Workers) {
+        if (worker->m_Thread.joinable()) {
+            worker->m_Thread.join();
+        }
+    }
+    // Periodic tasks that were running while the timer stopped.
+    ClearTimers();
+}
+
+void AsyncTask::AddTask(Task&& task) {
+    Job job{std::move(task), nullptr};
+    Submit(job);
+}
+
+AsyncTask::Status AsyncTask::AddTask(Task&& task, std::chrono::milliseconds timeout) {
+    Job job{std::move(task), nullptr};
+    const Status status = Submit(job, std::chrono::steady_clock::now() + timeout);
+    if (status != Status::OK) {
+        task = std::move(job.m_Task);
+    }
+    return status;
+}
+
+AsyncTask::Status AsyncTask::TryAddTask(Task&& task) {
+    Job job{std::move(task), nullptr};
+    const Status status = Submit(job, std::chrono::steady_clock::time_point::min());
+    if (status != Status::OK) {
+        task = std::move(job.m_Task);
+    }
+    return status;
+}
+
+void AsyncTask::AddTask(TaskGroup& group, Task&& task) {
+    ++group.m_Pending;
+    Job job{std::move(task), &group};
+    if (Submit(job) != Status::OK) {
+        FinishJob(job);
+    }
+}
+
+void AsyncTask::AddTask(Priority priority, Task&& task) {
+    if (priority == Priority::NORMAL) {
+        AddTask(std::move(task));
+    } else {
+        PushLane(priority == Priority::HIGH ? HIGH_LANE : LOW_LANE, std::chrono::steady_clock::now(), Job{std::move(task), nullptr});
+    }
+}
+
+void AsyncTask::AddTask(std::chrono::steady_clock::time_point deadline, Task&& task) {
+    PushLane(DEADLINE_LANE, deadline, Job{std::move(task), nullptr});
+}
+
+void AsyncTask::Post(Task&& task) {
+    // Counted like a task added from the pool, which is never held back.
+    ++m_PendingTasks;
+    if (m_StopRunning) {
+        FinishTasks(1);
+        return;
+    }
+    Job job{std::move(task), nullptr};
+    Stamp(job);
+    if (!m_SharedQueue.TryPush(std::move(job))) {
+        Lock lock(m_Mutex);
+        m_TaskQueue.emplace_back(std::move(job));
+        ++m_OverflowTasks;
+    }
+    if (!WakeOne()) {
+        MaybeSpawn();
+    }
+}
+
+AsyncTask::Status AsyncTask::Admit(std::chrono::steady_clock::time_point until) {
+    // Tasks of this pool, run by a worker or by a helping waiter, are what makes room, they never wait for it.
+    if (m_Policy.capacity == 0 || s_CurrentPool == this || s_ExecutingPool == this) {
+        ++m_PendingTasks;
+        return Status::OK;
+    }
+    size_t pending = m_PendingTasks.load();
+    while (true) {
+        if (pending < m_Policy.capacity) {
+            if (m_PendingTasks.compare_exchange_weak(pending, pending + 1)) {
+                return Status::OK;
+            }
+            continue;
+        }
+        if (m_StopRunning) {
+            return Status::STOPPED;
+        }
+        if (std::chrono::steady_clock::now() >= until) {
+            return Status::FULL;
+        }
+        // Pairs with FinishTasks: either it sees us blocked, or we see the room it made.
+        Lock lock(m_SpaceMutex);
+        ++m_BlockedSubmitters;
+        auto room = [this] { return m_StopRunning || m_PendingTasks.load() < m_Policy.capacity; };
+        if (until == std::chrono::steady_clock::time_point::max()) {
+            m_SpaceCondition.wait(lock, room);
+        } else {
+            m_SpaceCondition.wait_until(lock, until, room);
+        }
+        --m_BlockedSubmitters;
+        lock.unlock();
+        pending = m_PendingTasks.load();
+    }
+}
+
+void AsyncTask::AddTaskToNode(size_t node, Task&& task) {
+    Job job{std::move(task), nullptr};
+    if (Submit(job, std::chrono::steady_clock::time_point::max(), m_NodeQueues.empty() ? NO_NODE : node % m_NodeQueues.size()) != Status::OK) {
+        FinishJob(job);
+    }
+}
+
+AsyncTask::Status AsyncTask::Submit(Job& job, std::chrono::steady_clock::time_point until, size_t node) {
+    // Count the task before checking the flag, so the workers do not exit while it is on its way to the queue.
+    const Status status = Admit(until);
+    if (status != Status::OK) {
+        return status;
+    }
+    if (m_StopRunning) {
+        FinishTasks(1);
+        return Status::STOPPED;
+    }
+    Stamp(job);
+    if (s_CurrentPool == this && (node == NO_NODE || node == s_CurrentWorker->m_Node)) {
+        // Called from a running task, the job goes to the worker's own queue.
+        Lock lock = LockQueue(*s_CurrentWorker);
+        s_CurrentWorker->m_Jobs.PushBack(std::move(job));
+    } else if (node != NO_NODE && m_NodeQueues[node]->TryPush(std::move(job))) {
+    } else if (!m_SharedQueue.TryPush(std::move(job))) {
+        // A full node queue spills here too, the job only loses its locality.
+        Lock lock(m_Mutex);
+        m_TaskQueue.emplace_back(std::move(job));
+        ++m_OverflowTasks;
+    }
+    if (!WakeOne(node)) {
+        MaybeSpawn();
+    }
+    return Status::OK;
+}
+
+void AsyncTask::SubmitBatch(std::vector<Job>& jobs) {
+    const size_t count = jobs.size();
+    if (count == 0) {
+        return;
+    }
+    if (m_Policy.capacity != 0 && s_CurrentPool != this && s_ExecutingPool != this) {
+        // Bounded pools admit every task on its own, the batch may have to wait for room part way.
+        for (Job& job : jobs) {
+            if (Submit(job) != Status::OK) {
+                FinishJob(job);
+            }
+        }
+        return;
+    }
+    m_PendingTasks += count;
+    if (m_StopRunning) {
+        for (Job& job : jobs) {
+            FinishJob(job);
+        }
+        FinishTasks(count);
+        return;
+    }
+    Stamp(jobs);
+    if (s_CurrentPool == this) {
+        Lock lock = LockQueue(*s_CurrentWorker);
+        PushJobs(*s_CurrentWorker, jobs, 0, count);
+    } else {
+        // A run per live worker, starting where the wakeups start, so the woken workers mostly find work in their own
+        // queue. With no thread running yet, a run per slot MaybeSpawn starts a thread in first.
+        const size_t workers = m_Workers.size();
+        size_t live = 0;
+        for (const auto& worker : m_Workers) {
+            live += worker->m_Alive.load() ? 1 : 0;
+        }
+        const size_t slots = live != 0 ? live : std::min(m_MaxThreads, workers);
+        const size_t runs = std::min(count, slots);
+        const size_t start = live != 0 ? m_WakeCursor.load(std::memory_order_relaxed) : 0;
+        size_t begin = 0;
+        size_t run = 0;
+        Worker* last = m_Workers[start % workers].get();
+        for (size_t i = 0; i < workers && run < runs; ++i) {
+            const size_t index = (start + i) % workers;
+            if (live != 0 ? !m_Workers[index]->m_Alive.load() : index >= slots) {
+                continue;
+            }
+            last = m_Workers[index].get();
+            const size_t end = count * ++run / runs;
+            std::lock_guard<std::mutex> guard(last->m_QueueMutex);
+            PushJobs(*last, jobs, begin, end);
+            begin = end;
+        }
+        if (begin < count) {
+            // Threads exited while the runs were handed out, the rest goes to the last run.
+            std::lock_guard<std::mutex> guard(last->m_QueueMutex);
+            PushJobs(*last, jobs, begin, count);
+        }
+    }
+    size_t woken = 0;
+    while (woken < count && WakeOne()) {
+        ++woken;
+    }
+    if (woken < count) {
+        MaybeSpawn(count - woken);
+    }
+}
+
+void AsyncTask::PushJobs(Worker& worker, std::vector<Job>& jobs, size_t begin, size_t end) {
+    worker.m_Jobs.Reserve(end - begin);
+    for (; begin < end; ++begin) {
+        worker.m_Jobs.PushBack(std::move(jobs[begin]));
+    }
+}
+
+void AsyncTask::Shutdown(bool force) {
+    Lock lock(m_Mutex);
+    m_StopRunning = true;
+    std::list<Job> cleared;
+    if (force) {
+        // Clear pending task.
+        cleared.splice(cleared.end(), m_TaskQueue);
+        m_OverflowTasks = 0;
+        Job job;
+        while (m_SharedQueue.TryPop(job)) {
+            cleared.emplace_back(std::move(job));
+        }
+        for (auto& worker : m_Workers) {
+            std::lock_guard<std::mutex> guard(worker->m_QueueMutex);
+            for (; !worker->m_Jobs.Empty(); worker->m_Jobs.PopFront()) {
+                cleared.emplace_back(std::move(worker->m_Jobs.Front()));
+            }
+        }
+        while (PopLane(HIGH_LANE, job) || PopLane(DEADLINE_LANE, job) || PopLane(LOW_LANE, job) || PopNodes(0, job)) {
+            cleared.emplace_back(std::move(job));
+        }
+    }
+    lock.unlock();
+    // Submitters waiting for room give up.
+    { Lock guard(m_SpaceMutex); }
+    m_SpaceCondition.notify_all();
+
+    for (Job& job : cleared) {
+        FinishJob(job);
+    }
+    if (!cleared.empty()) {
+        FinishTasks(cleared.size());
+    }
+    // Wake the parked workers, they exit once nothing is pending.
+    WakeAll();
+}
+
+bool AsyncTask::WakeOne(size_t node) {
+    // Pairs with the increment in Park: either we see the sleeper, or its re-scan sees our task.
+    if (m_Sleepers.load() == 0) {
+        return false;
+    }
+    if (node != NO_NODE) {
+        for (size_t index : m_NodeWorkers[node]) {
+            if (Unpark(*m_Workers[index])) {
+                return true;
+            }
+        }
+    }
+    const size_t count = m_Workers.size();
+    const size_t start = m_WakeCursor.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        if (Unpark(*m_Workers[(start + i) % count])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AsyncTask::Unpark(Worker& worker) {
+    bool parked = true;
+    if (!worker.m_Parked.load(std::memory_order_relaxed) || !worker.m_Parked.compare_exchange_strong(parked, false)) {
+        return false;
+    }
+    --m_Sleepers;
+    {
+        std::lock_guard<std::mutex> guard(worker.m_ParkMutex);
+        worker.m_Signaled = true;
+    }
+    worker.m_ParkCondition.notify_one();
+    return true;
+}
+
+void AsyncTask::MaybeSpawn(size_t count) {
+    // Workers move from parked to spinning to retiring by incrementing the next counter before decrementing the
+    // previous one, and each of them scans the queues after the move. Reading the counters in the same order, either we
+    // see one of them or the worker sees our task.
+    const size_t spinning = m_Spinning.load();
+    if (spinning >= count) {
+        return;
+    }
+    if (m_Retiring.load() == 0 && m_AliveThreads.load() >= ThreadLimit()) {
+        return;
+    }
+    Lock lock(m_Mutex);
+    if (m_StopRunning) {
+        return;
+    }
+    size_t spawned = 0;
+    while (spawned < count - spinning && SpawnLocked()) {
+        ++spawned;
+    }
+    if (spawned == 0 && m_Retiring.load() > 0) {
+        m_SpawnRequested = true;
+    }
+}
+
+void AsyncTask::HandOff() {
+    const size_t idle = m_Sleepers.load() + m_Spinning.load();
+    const size_t busy = m_AliveThreads.load() > idle ? m_AliveThreads.load() - idle : 0;
+    if (m_PendingTasks.load() > busy && !WakeOne()) {
+        MaybeSpawn();
+    }
+}
+
+bool AsyncTask::SpawnLocked() {
+    if (m_AliveThreads.load() >= ThreadLimit()) {
+        return false;
+    }
+    for (size_t i = 0; i < m_Workers.size(); ++i) {
+        Worker& worker = *m_Workers[i];
+        if (worker.m_Alive) {
+            continue;
+        }
+        // A retired thread does not touch its slot after releasing the lock, so this join does not wait long.
+        if (worker.m_Thread.joinable()) {
+            worker.m_Thread.join();
+        }
+        try {
+            worker.m_Thread = std::thread(&AsyncTask::Loop, this, i);
+        } catch (...) {
+            return false;
+        }
+        worker.m_Alive = true;
+        ++m_AliveThreads;
+        return true;
+    }
+    return false;
+}
+
+size_t AsyncTask::ThreadLimit() const {
+    return m_MaxThreads + std::min(m_Blocked.load(), m_Policy.maxblocking);
+}
+
+AsyncTask::BlockingRegion::BlockingRegion() noexcept : m_Pool(s_CurrentPool) {
+    if (m_Pool && s_CurrentWorker->m_Blocking++ == 0) {
+        m_Pool->EnterBlocking();
+    }
+}
+
+AsyncTask::BlockingRegion::~BlockingRegion() {
+    if (m_Pool && --s_CurrentWorker->m_Blocking == 0) {
+        m_Pool->LeaveBlocking();
+    }
+}
+
+void AsyncTask::EnterBlocking() {
+    ++m_Blocked;
+    // Hand the queued work, if any, to somebody else. Tasks added later find the raised limit in MaybeSpawn.
+    HandOff();
+}
+
+void AsyncTask::LeaveBlocking() {
+    // A surplus thread exits at its next task boundary, see RetireExcess. Wake a parked one so it does not wait for the
+    // idle timeout to do so.
+    --m_Blocked;
+    if (m_AliveThreads.load() > ThreadLimit()) {
+        WakeOne();
+    }
+}
+
+bool AsyncTask::RetireExcess(size_t index) {
+    Worker& worker = *m_Workers[index];
+    {
+        std::lock_guard<std::mutex> guard(worker.m_QueueMutex);
+        if (!worker.m_Jobs.Empty()) {
+            return false;
+        }
+    }
+    Lock lock(m_Mutex);
+    if (m_AliveThreads.load() <= ThreadLimit()) {
+        return false;
+    }
+    worker.m_Alive = false;
+    --m_AliveThreads;
+    return true;
+}
+
+void AsyncTask::WakeAll() {
+    for (auto& worker : m_Workers) {
+        // Taking the slot lock orders the wakeup after the state change the predicate in Park checks.
+        { std::lock_guard<std::mutex> guard(worker->m_ParkMutex); }
+        worker->m_ParkCondition.notify_one();
+    }
+}
+
+void AsyncTask::FinishTasks(size_t count) {
+    const size_t pending = m_PendingTasks.fetch_sub(count) - count;
+    if (m_BlockedSubmitters.load() > 0) {
+        { Lock lock(m_SpaceMutex); }
+        if (count == 1) {
+            m_SpaceCondition.notify_one();
+        } else {
+            m_SpaceCondition.notify_all();
+        }
+    }
+    // Tasks blocked in WaitForComplete are waiting for exactly this.
+    if (pending <= m_WaitingTasks.load()) {
+        {
+            Lock lock(m_Mutex);
+        }
+        // No pending tasks and running tasks.
+        m_Condition.notify_all();
+        if (m_StopRunning) {
+            WakeAll();
+        }
+    }
+}
+
+void AsyncTask::FinishJob(Job& job) {
+    if (job.m_Group) {
+        job.m_Group->Finish(1);
+    }
+}
+
+bool AsyncTask::PopShared(Job& job) {
+    if (m_SharedQueue.TryPop(job)) {
+        return true;
+    }
+    if (m_OverflowTasks.load() == 0) {
+        return false;
+    }
+    Lock lock(m_Mutex);
+    if (m_TaskQueue.empty()) {
+        return false;
+    }
+    job = std::move(m_TaskQueue.front());
+    m_TaskQueue.pop_front();
+    --m_OverflowTasks;
+    return true;
+}
+
+void AsyncTask::PushLane(size_t lane, std::chrono::steady_clock::time_point due, Job&& job) {
+    // Same accounting as Submit.
+    if (Admit(std::chrono::steady_clock::time_point::max()) != Status::OK) {
+        FinishJob(job);
+        return;
+    }
+    if (m_StopRunning) {
+        FinishJob(job);
+        FinishTasks(1);
+        return;
+    }
+    Stamp(job);
+    Lane& target = m_Lanes[lane];
+    {
+        std::lock_guard<std::mutex> guard(target.m_Mutex);
+        target.m_Jobs.PushBack(LaneJob{std::move(job), due});
+        if (lane == DEADLINE_LANE) {
+            std::push_heap(target.m_Jobs.Data(), target.m_Jobs.Data() + target.m_Jobs.Size(), [](const LaneJob& left, const LaneJob& right) { return left.m_Due > right.m_Due; });
+        }
+        target.m_FrontDue = target.m_Jobs.Front().m_Due.time_since_epoch().count();
+        ++target.m_Size;
+        ++m_LaneTasks;
+    }
+    if (!WakeOne()) {
+        MaybeSpawn();
+    }
+}
+
+bool AsyncTask::PopLane(size_t lane, Job& job) {
+    Lane& source = m_Lanes[lane];
+    if (source.m_Size.load() == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(source.m_Mutex);
+    if (source.m_Jobs.Empty()) {
+        return false;
+    }
+    if (lane == DEADLINE_LANE) {
+        std::pop_heap(source.m_Jobs.Data(), source.m_Jobs.Data() + source.m_Jobs.Size(), [](const LaneJob& left, const LaneJob& right) { return left.m_Due > right.m_Due; });
+        job = std::move(source.m_Jobs.Back().m_Job);
+        source.m_Jobs.PopBack();
+    } else {
+        job = std::move(source.m_Jobs.Front().m_Job);
+        source.m_Jobs.PopFront();
+    }
+    if (!source.m_Jobs.Empty()) {
+        source.m_FrontDue = source.m_Jobs.Front().m_Due.time_since_epoch().count();
+    }
+    --source.m_Size;
+    --m_LaneTasks;
+    return true;
+}
+
+bool AsyncTask::PopUrgent(Job& job) {
+    if (m_LaneTasks.load() == 0) {
+        return false;
+    }
+    const Lane& low = m_Lanes[LOW_LANE];
+    if (low.m_Size.load() > 0) {
+        const auto age = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(low.m_FrontDue.load());
+        if (age >= m_Policy.agelimit && PopLane(LOW_LANE, job)) {
+            return true;
+        }
+    }
+    const Lane& high = m_Lanes[HIGH_LANE];
+    const Lane& deadline = m_Lanes[DEADLINE_LANE];
+    const bool has_high = high.m_Size.load() > 0;
+    bool has_deadline = false;
+    if (deadline.m_Size.load() > 0) {
+        // Only a deadline within the window is urgent.
+        const auto left = std::chrono::steady_clock::duration(deadline.m_FrontDue.load()) - std::chrono::steady_clock::now().time_since_epoch();
+        has_deadline = left <= m_Policy.deadlinewindow;
+    }
+    if (has_high && (!has_deadline || high.m_FrontDue.load() <= deadline.m_FrontDue.load())) {
+        return PopLane(HIGH_LANE, job) || (has_deadline && PopLane(DEADLINE_LANE, job));
+    }
+    return has_deadline && (PopLane(DEADLINE_LANE, job) || PopLane(HIGH_LANE, job));
+}
+
+bool AsyncTask::CanExit() const {
+    return m_StopRunning && m_PendingTasks.load() == 0;
+}
+
+bool AsyncTask::Steal(size_t index, Job& job) {
+    // index is the thief's own slot, or m_Workers.size() for a non-worker thread that may steal from all of them.
+    const size_t count = m_Workers.size();
+    if (index < count && !m_Workers[index]->m_Victims.empty()) {
+        for (size_t victim : m_Workers[index]->m_Victims) {
+            if (StealFrom(*m_Workers[victim], job)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    const size_t victims = index < count ? count - 1 : count;
+    for (size_t i = 1; i <= victims; ++i) {
+        if (StealFrom(*m_Workers[(index + i) % count], job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AsyncTask::StealFrom(Worker& victim, Job& job) {
+    Lock lock = LockQueue(victim);
+    if (victim.m_Jobs.Empty()) {
+        return false;
+    }
+    job = std::move(victim.m_Jobs.Front());
+    victim.m_Jobs.PopFront();
+    lock.unlock();
+#if ASYNCTASK_STATS
+    Counters& counters = CurrentCounters();
+    counters.Add(counters.m_Steals, 1);
+#endif
+    return true;
+}
+
+AsyncTask::Lock AsyncTask::LockQueue(Worker& worker) {
+#if ASYNCTASK_STATS
+    Lock lock(worker.m_QueueMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        Counters& counters = CurrentCounters();
+        counters.Add(counters.m_Contended, 1);
+        lock.lock();
+    }
+    return lock;
+#else
+    return Lock(worker.m_QueueMutex);
+#endif
+}
+
+#if ASYNCTASK_STATS
+AsyncTask::Counters& AsyncTask::CurrentCounters() {
+    return s_CurrentPool == this ? s_CurrentWorker->m_Counters : m_ExternalCounters;
+}
+
+size_t AsyncTask::Bucket(uint64_t nanos) {
+    size_t bucket = 0;
+    while (nanos > 1 && bucket + 1 < HISTOGRAM_BUCKETS) {
+        nanos >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+#endif
+
+AsyncTask::Statistics AsyncTask::Stats() const {
+    Statistics stats;
+#if ASYNCTASK_STATS
+    auto collect = [&stats](const Counters& counters) {
+        Statistics::Thread thread;
+        thread.executed = counters.m_Executed.load(std::memory_order_relaxed);
+        thread.steals = counters.m_Steals.load(std::memory_order_relaxed);
+        thread.parks = counters.m_Parks.load(std::memory_order_relaxed);
+        thread.contended = counters.m_Contended.load(std::memory_order_relaxed);
+        thread.wait = std::chrono::nanoseconds(counters.m_WaitNanos.load(std::memory_order_relaxed));
+        thread.run = std::chrono::nanoseconds(counters.m_RunNanos.load(std::memory_order_relaxed));
+        thread.idle = std::chrono::nanoseconds(counters.m_IdleNanos.load(std::memory_order_relaxed));
+        thread.parked = std::chrono::nanoseconds(counters.m_ParkNanos.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            stats.wait_histogram[i] += counters.m_WaitHistogram[i].load(std::memory_order_relaxed);
+            stats.run_histogram[i] += counters.m_RunHistogram[i].load(std::memory_order_relaxed);
+        }
+        stats.total.executed += thread.executed;
+        stats.total.steals += thread.steals;
+        stats.total.parks += thread.parks;
+        stats.total.contended += thread.contended;
+        stats.total.wait += thread.wait;
+        stats.total.run += thread.run;
+        stats.total.idle += thread.idle;
+        stats.total.parked += thread.parked;
+        stats.threads.push_back(thread);
+    };
+    for (const auto& worker : m_Workers) {
+        collect(worker->m_Counters);
+    }
+    collect(m_ExternalCounters);
+#endif
+    stats.pending = m_PendingTasks.load();
+    stats.alive = m_AliveThreads.load();
+    stats.sleeping = m_Sleepers.load();
+    for (const auto& worker : m_Workers) {
+        std::lock_guard<std::mutex> guard(worker->m_QueueMutex);
+        stats.queue_slots.push_back(worker->m_Jobs.Capacity());
+    }
+    return stats;
+}
+
+std::chrono::nanoseconds AsyncTask::Statistics::Percentile(const std::array<uint64_t, HISTOGRAM_BUCKETS>& histogram, double fraction) {
+    const uint64_t total = std::accumulate(histogram.begin(), histogram.end(), uint64_t(0));
+    if (total == 0) {
+        return std::chrono::nanoseconds(0);
+    }
+    const double target = fraction * static_cast<double>(total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram[i];
+        if (static_cast<double>(seen) >= target) {
+            return std::chrono::nanoseconds(uint64_t(2) << i);
+        }
+    }
+    return std::chrono::nanoseconds(uint64_t(1) << HISTOGRAM_BUCKETS);
+}
+
+void AsyncTask::Stamp([[maybe_unused]] Job& job) {
+#if ASYNCTASK_STATS
+    job.m_Queued = std::chrono::steady_clock::now();
+#endif
+#if ASYNCTASK_TRACE
+    if (m_Tracing.load(std::memory_order_relaxed)) {
+        TraceRing& ring = CurrentTraceRing();
+        job.m_TraceId = (uint64_t(ring.m_Serial + 1) << 40) | ++ring.m_NextId;
+        job.m_TraceParent = s_TraceTask;
+        job.m_TraceLabel = s_TraceLabel;
+        Record(TRACE_SUBMIT, job);
+    }
+#endif
+}
+
+void AsyncTask::Stamp([[maybe_unused]] std::vector<Job>& jobs) {
+#if ASYNCTASK_STATS
+    // One clock read for the batch.
+    const auto queued = std::chrono::steady_clock::now();
+    for (Job& job : jobs) {
+        job.m_Queued = queued;
+    }
+#endif
+#if ASYNCTASK_TRACE
+    if (m_Tracing.load(std::memory_order_relaxed)) {
+        TraceRing& ring = CurrentTraceRing();
+        for (Job& job : jobs) {
+            job.m_TraceId = (uint64_t(ring.m_Serial + 1) << 40) | ++ring.m_NextId;
+            job.m_TraceParent = s_TraceTask;
+            job.m_TraceLabel = s_TraceLabel;
+            Record(TRACE_SUBMIT, job);
+        }
+    }
+#endif
+}
+
+void AsyncTask::StartTrace() {
+#if ASYNCTASK_TRACE
+    m_Tracing.store(true);
+#endif
+}
+
+void AsyncTask::StopTrace() {
+#if ASYNCTASK_TRACE
+    m_Tracing.store(false);
+#endif
+}
+
+AsyncTask::TraceLabel::TraceLabel(const char* label) {
+#if ASYNCTASK_TRACE
+    m_Previous = s_TraceLabel;
+    s_TraceLabel = label;
+#else
+    m_Previous = label;
+#endif
+}
+
+AsyncTask::TraceLabel::~TraceLabel() {
+#if ASYNCTASK_TRACE
+    s_TraceLabel = m_Previous;
+#endif
+}
+
+#if ASYNCTASK_TRACE
+AsyncTask::TraceOwner::~TraceOwner() {
+    if (m_Ring != nullptr) {
+        std::lock_guard<std::mutex> guard(Registry().m_Mutex);
+        m_Ring->m_Owned = false;
+    }
+}
+
+AsyncTask::TraceRegistry& AsyncTask::Registry() {
+    // Never destroyed, threads may still give their rings back during static destruction.
+    static TraceRegistry* registry = new TraceRegistry;
+    return *registry;
+}
+
+AsyncTask::TraceRing& AsyncTask::CurrentTraceRing() {
+    if (s_TraceOwner.m_Ring == nullptr) {
+        TraceRegistry& registry = Registry();
+        std::lock_guard<std::mutex> guard(registry.m_Mutex);
+        for (auto& ring : registry.m_Rings) {
+            if (!ring->m_Owned) {
+                s_TraceOwner.m_Ring = ring.get();
+                break;
+            }
+        }
+        if (s_TraceOwner.m_Ring == nullptr) {
+            registry.m_Rings.emplace_back(new TraceRing);
+            s_TraceOwner.m_Ring = registry.m_Rings.back().get();
+            s_TraceOwner.m_Ring->m_Serial = registry.m_Rings.size() - 1;
+        }
+        s_TraceOwner.m_Ring->m_Owned = true;
+    }
+    return *s_TraceOwner.m_Ring;
+}
+
+uint64_t AsyncTask::TraceClock() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+}
+
+void AsyncTask::Record(TraceType type, const Job& job) {
+    TraceRing& ring = CurrentTraceRing();
+    const uint64_t head = ring.m_Head.load(std::memory_order_relaxed);
+    TraceEvent& event = ring.m_Events[head % TRACE_EVENTS];
+    // Orders the head published by the previous event before the overwrite, see WriteTrace.
+    std::atomic_thread_fence(std::memory_order_release);
+    event.m_Time.store(TraceClock(), std::memory_order_relaxed);
+    event.m_Id.store(job.m_TraceId, std::memory_order_relaxed);
+    event.m_Parent.store(job.m_TraceParent, std::memory_order_relaxed);
+    event.m_Label.store(job.m_TraceLabel, std::memory_order_relaxed);
+    event.m_Pool.store(this, std::memory_order_relaxed);
+    event.m_Worker.store(s_CurrentPool == this ? s_CurrentWorker->m_Index : NO_WORKER, std::memory_order_relaxed);
+    event.m_Type.store(type, std::memory_order_relaxed);
+    ring.m_Head.store(head + 1, std::memory_order_release);
+}
+#endif
+
+void AsyncTask::WriteTrace(std::ostream& out) const {
+    out << "{\"traceEvents\":[";
+#if ASYNCTASK_TRACE
+    struct Copy {
+        uint64_t m_Time;
+        uint64_t m_Id;
+        uint64_t m_Parent;
+        const char* m_Label;
+        size_t m_Worker;
+        uint8_t m_Type;
+    };
+    // Workers are threads 0 to N-1, the threads outside the pool follow by ring.
+    auto tid = [this](size_t worker, size_t serial) { return worker != NO_WORKER ? worker : m_Workers.size() + serial; };
+    auto name = [](const char* label) {
+        std::string escaped;
+        for (const char* c = label != nullptr ? label : "task"; *c != '\0'; ++c) {
+            if (*c == '"' || *c == '\\') {
+                escaped += '\\';
+            }
+            if (static_cast<unsigned char>(*c) >= 0x20) {
+                escaped += *c;
+            }
+        }
+        return escaped;
+    };
+    bool first = true;
+    auto separate = [&out, &first]() {
+        out << (first ? "\n" : ",\n");
+        first = false;
+    };
+    std::vector<bool> named;
+    std::vector<Copy> events;
+    TraceRegistry& registry = Registry();
+    std::lock_guard<std::mutex> guard(registry.m_Mutex);
+    for (auto& ring : registry.m_Rings) {
+        const uint64_t head = ring->m_Head.load(std::memory_order_acquire);
+        const uint64_t from = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+        events.clear();
+        for (uint64_t i = from; i < head; ++i) {
+            const TraceEvent& event = ring->m_Events[i % TRACE_EVENTS];
+            if (event.m_Pool.load(std::memory_order_relaxed) != this) {
+                events.push_back(Copy{0, 0, 0, nullptr, NO_WORKER, 0xff});
+                continue;
+            }
+            events.push_back(Copy{event.m_Time.load(std::memory_order_relaxed), event.m_Id.load(std::memory_order_relaxed),
+                                  event.m_Parent.load(std::memory_order_relaxed), event.m_Label.load(std::memory_order_relaxed),
+                                  event.m_Worker.load(std::memory_order_relaxed), event.m_Type.load(std::memory_order_relaxed)});
+        }
+        // The owner may have overwritten the oldest events while they were copied, those are dropped.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t now = ring->m_Head.load(std::memory_order_relaxed);
+        const uint64_t valid = now >= TRACE_EVENTS ? now - TRACE_EVENTS + 1 : 0;
+        for (uint64_t i = from; i < head; ++i) {
+            const Copy& event = events[i - from];
+            if (i < valid || event.m_Type == 0xff) {
+                continue;
+            }
+            const size_t thread = tid(event.m_Worker, ring->m_Serial);
+            if (named.size() <= thread) {
+                named.resize(thread + 1, false);
+            }
+            if (!named[thread]) {
+                named[thread] = true;
+                separate();
+                out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread << ",\"args\":{\"name\":\""
+                    << (event.m_Worker != NO_WORKER ? "worker " : "thread ") << (event.m_Worker != NO_WORKER ? event.m_Worker : ring->m_Serial)
+                    << "\"}}";
+            }
+            const std::string ts = std::to_string(event.m_Time / 1000) + "." + std::to_string(1000 + event.m_Time % 1000).substr(1);
+            const std::string common = ",\"ts\":" + ts + ",\"pid\":1,\"tid\":" + std::to_string(thread);
+            const std::string label = name(event.m_Label);
+            separate();
+            switch (event.m_Type) {
+                case TRACE_SUBMIT:
+                    out << "{\"name\":\"submit " << label << "\",\"cat\":\"submit\",\"ph\":\"i\",\"s\":\"t\"" << common << ",\"args\":{\"id\":"
+                        << event.m_Id << ",\"parent\":" << event.m_Parent << "}},\n";
+                    out << "{\"name\":\"" << label << "\",\"cat\":\"flow\",\"ph\":\"s\",\"id\":" << event.m_Id << common << "}";
+                    break;
+                case TRACE_START:
+                    out << "{\"name\":\"" << label << "\",\"cat\":\"flow\",\"ph\":\"f\",\"bp\":\"e\",\"id\":" << event.m_Id << common << "},\n";
+                    out << "{\"name\":\"" << label << "\",\"cat\":\"task\",\"ph\":\"B\"" << common << ",\"args\":{\"id\":" << event.m_Id
+                        << ",\"parent\":" << event.m_Parent << "}}";
+                    break;
+                default:
+                    out << "{\"name\":\"" << label << "\",\"cat\":\"task\",\"ph\":\"E\"" << common << "}";
+                    break;
+            }
+        }
+    }
+#endif
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+bool AsyncTask::PopNodes(size_t first, Job& job) {
+    const size_t count = m_NodeQueues.size();
+    for (size_t i = 1; i <= count; ++i) {
+        if (m_NodeQueues[(first + i) % count]->TryPop(job)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<int> AsyncTask::ParseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        int first = 0;
+        int last = 0;
+        char dash = 0;
+        std::istringstream parser(range);
+        if (!(parser >> first)) {
+            continue;
+        }
+        last = first;
+        if (parser >> dash >> last && dash != '-') {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int>> AsyncTask::ReadTopology() {
+    std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {{}};
+    }
+    std::string line;
+    std::ifstream online("/sys/devices/system/node/online");
+    if (online && std::getline(online, line)) {
+        for (int node : ParseCpuList(line)) {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::vector<int> cpus;
+            if (cpulist && std::getline(cpulist, line)) {
+                for (int cpu : ParseCpuList(line)) {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            // Memory-only nodes and nodes outside our cpuset have no worker to run.
+            if (!cpus.empty()) {
+                nodes.emplace_back(std::move(cpus));
+            }
+        }
+    }
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                nodes.back().push_back(cpu);
+            }
+        }
+    }
+#else
+    nodes.emplace_back();
+#endif
+    return nodes;
+}
+
+void AsyncTask::Place() {
+    if (!m_Policy.pinning && !m_Policy.numa) {
+        return;
+    }
+    std::vector<std::vector<int>> nodes = ReadTopology();
+    if (!m_Policy.numa && nodes.size() > 1) {
+        // Pinning alone still spreads the workers over the nodes, but they all share one node entry.
+        size_t widest = 0;
+        for (const auto& cpus : nodes) {
+            widest = std::max(widest, cpus.size());
+        }
+        std::vector<int> all;
+        for (size_t i = 0; i < widest; ++i) {
+            for (const auto& cpus : nodes) {
+                if (i < cpus.size()) {
+                    all.push_back(cpus[i]);
+                }
+            }
+        }
+        nodes.assign(1, std::move(all));
+    }
+    const size_t count = nodes.size();
+    for (auto& worker : m_Workers) {
+        worker->m_Node = worker->m_Index % count;
+        const std::vector<int>& cpus = nodes[worker->m_Node];
+        if (m_Policy.pinning && !cpus.empty()) {
+            worker->m_Cpu = cpus[worker->m_Index / count % cpus.size()];
+        }
+    }
+    if (count == 1) {
+        m_NodeCpus = std::move(nodes);
+        return;
+    }
+    m_NodeWorkers.resize(count);
+    for (auto& worker : m_Workers) {
+        m_NodeWorkers[worker->m_Node].push_back(worker->m_Index);
+    }
+    for (auto& worker : m_Workers) {
+        // Same node first, each list rotated so the thieves of a node do not all start with the same victim.
+        for (size_t step = 0; step < count; ++step) {
+            const auto& group = m_NodeWorkers[(worker->m_Node + step) % count];
+            for (size_t i = 0; i < group.size(); ++i) {
+                const size_t victim = group[(worker->m_Index / count + 1 + i) % group.size()];
+                if (victim != worker->m_Index) {
+                    worker->m_Victims.push_back(victim);
+                }
+            }
+        }
+    }
+    m_NodeQueues.resize(count);
+    for (auto& queue : m_NodeQueues) {
+        queue = std::make_unique<MpmcQueue<Job>>(NODE_QUEUE_CAPACITY);
+    }
+    m_NodeCpus = std::move(nodes);
+}
+
+void AsyncTask::Bind(const Worker& worker) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (worker.m_Cpu >= 0) {
+        CPU_SET(worker.m_Cpu, &set);
+    } else if (!m_NodeQueues.empty() && !m_NodeCpus[worker.m_Node].empty()) {
+        for (int cpu : m_NodeCpus[worker.m_Node]) {
+            CPU_SET(cpu, &set);
+        }
+    } else {
+        return;
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void)worker;
+#endif
+}
+
+bool AsyncTask::FindTask(size_t index, Job& job) {
+    Worker& own = *m_Workers[index];
+    if (own.m_UrgentRun < URGENT_BURST && PopUrgent(job)) {
+        ++own.m_UrgentRun;
+        return true;
+    }
+    own.m_UrgentRun = 0;
+    {
+        Lock lock = LockQueue(own);
+        if (!own.m_Jobs.Empty()) {
+            job = std::move(own.m_Jobs.Back());
+            own.m_Jobs.PopBack();
+            return true;
+        }
+    }
+    if (!m_NodeQueues.empty() && m_NodeQueues[own.m_Node]->TryPop(job)) {
+        return true;
+    }
+    if (PopShared(job) || Steal(index, job) || PopNodes(own.m_Node, job)) {
+        return true;
+    }
+    // No normal task, the urgent ones after a burst, then the deadlines outside the window and the LOW tasks.
+    return PopUrgent(job) || PopLane(DEADLINE_LANE, job) || PopLane(LOW_LANE, job);
+}
+
+bool AsyncTask::Park(size_t index, Job& job) {
+    Worker& worker = *m_Workers[index];
+    worker.m_Parked = true;
+    ++m_Sleepers;
+    --m_Spinning;
+    // Scan again after announcing ourselves, a submission from now on either sees us parked or its task is found here.
+    if (FindTask(index, job)) {
+        bool parked = true;
+        if (worker.m_Parked.compare_exchange_strong(parked, false)) {
+            --m_Sleepers;
+        } else {
+            // A submitter picked us meanwhile, consume its signal and pass the wakeup on to somebody else.
+            Lock lock(worker.m_ParkMutex);
+            worker.m_ParkCondition.wait(lock, [&worker] { return worker.m_Signaled; });
+            worker.m_Signaled = false;
+            lock.unlock();
+            WakeOne();
+        }
+        return true;
+    }
+
+    Lock lock(worker.m_ParkMutex);
+#if ASYNCTASK_STATS
+    const auto sleep = std::chrono::steady_clock::now();
+#endif
+    auto wakeup = [this, &worker] { return worker.m_Signaled || CanExit(); };
+    if (m_AliveThreads.load() > m_Policy.minthread) {
+        worker.m_ParkCondition.wait_for(lock, m_Policy.idletimeout, wakeup);
+    } else {
+        worker.m_ParkCondition.wait(lock, wakeup);
+    }
+#if ASYNCTASK_STATS
+    worker.m_Counters.Add(worker.m_Counters.m_Parks, 1);
+    worker.m_Counters.Add(worker.m_Counters.m_ParkNanos, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sleep).count());
+#endif
+    if (worker.m_Signaled) {
+        worker.m_Signaled = false;
+        return true;
+    }
+    lock.unlock();
+
+    const bool exiting = CanExit();
+    if (!exiting) {
+        ++m_Retiring;
+    }
+    // Withdraw from the parking slot unless a submitter is about to signal it.
+    bool parked = true;
+    if (!worker.m_Parked.compare_exchange_strong(parked, false)) {
+        lock.lock();
+        worker.m_ParkCondition.wait(lock, [&worker] { return worker.m_Signaled; });
+        worker.m_Signaled = false;
+        lock.unlock();
+        if (!exiting) {
+            --m_Retiring;
+            return true;
+        }
+    } else {
+        --m_Sleepers;
+    }
+    if (exiting) {
+        Lock guard(m_Mutex);
+        worker.m_Alive = false;
+        --m_AliveThreads;
+        return false;
+    }
+    const bool keep = Retire(index, job);
+    --m_Retiring;
+    return keep;
+}
+
+bool AsyncTask::Retire(size_t index, Job& job) {
+    // A submitter that saw m_Retiring either has its task found here or asks for a thread under the lock below.
+    if (FindTask(index, job)) {
+        return true;
+    }
+    Lock lock(m_Mutex);
+    if (m_SpawnRequested || m_AliveThreads.load() <= m_Policy.minthread || m_StopRunning) {
+        // Somebody needs a thread, or we are one of the minimum ones, or shutting down: go around again.
+        m_SpawnRequested = false;
+        return true;
+    }
+    m_Workers[index]->m_Alive = false;
+    --m_AliveThreads;
+    return false;
+}
+
+void AsyncTask::Loop(size_t index) {
+    s_CurrentPool = this;
+    s_CurrentWorker = m_Workers[index].get();
+    Bind(*s_CurrentWorker);
+    size_t spins = 0;
+    bool spinning = false;
+#if ASYNCTASK_STATS
+    Counters& counters = s_CurrentWorker->m_Counters;
+    auto idle = std::chrono::steady_clock::now();
+#endif
+    while (true) {
+        Job job;
+        // Cheap check first, ThreadLimit only drops below the thread count when a BlockingRegion ends.
+        if (m_AliveThreads.load(std::memory_order_relaxed) > m_MaxThreads && m_AliveThreads.load() > ThreadLimit() && RetireExcess(index)) {
+            if (spinning) {
+                --m_Spinning;
+            }
+            break;
+        }
+        if (!FindTask(index, job)) {
+            if (!spinning) {
+                spinning = true;
+                ++m_Spinning;
+#if ASYNCTASK_STATS
+                idle = std::chrono::steady_clock::now();
+#endif
+            }
+            if (spins < m_Policy.spincount) {
+                ++spins;
+                CpuRelax();
+                continue;
+            }
+            spins = 0;
+            // Park takes the spinning count over.
+            spinning = false;
+#if ASYNCTASK_STATS
+            counters.Add(counters.m_IdleNanos, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - idle).count());
+#endif
+            if (!Park(index, job)) {
+                break;
+            }
+            if (!job.m_Task) {
+                continue;
+            }
+        }
+        if (spinning) {
+            spinning = false;
+            // Submitters that saw the last spinner left their tasks to it, hand on the ones it does not run.
+            if (--m_Spinning == 0) {
+                HandOff();
+            }
+#if ASYNCTASK_STATS
+            counters.Add(counters.m_IdleNanos, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - idle).count());
+#endif
+        }
+        spins = 0;
+        Execute(job);
+    }
+    s_CurrentPool = nullptr;
+    s_CurrentWorker = nullptr;
+}
+
+bool AsyncTask::TimerHandle::Cancel() {
+    std::shared_ptr<TimerNode> node = m_Node.lock();
+    if (!node) {
+        return false;
+    }
+    int state = TimerNode::WAITING;
+    return node->m_State.compare_exchange_strong(state, TimerNode::CANCELLED);
+}
+
+AsyncTask::TimerHandle AsyncTask::AddDelayedTask(std::chrono::milliseconds delay, Task&& task) {
+    return AddDelayed(std::chrono::steady_clock::now() + delay, std::chrono::milliseconds(0), std::move(task));
+}
+
+AsyncTask::TimerHandle AsyncTask::AddPeriodicTask(std::chrono::milliseconds period, Task&& task) {
+    period = std::max(period, std::chrono::milliseconds(1));
+    return AddDelayed(std::chrono::steady_clock::now() + period, period, std::move(task));
+}
+
+AsyncTask::TimerHandle AsyncTask::AddDelayed(std::chrono::steady_clock::time_point due, std::chrono::milliseconds period, Task&& task) {
+    TimerHandle handle;
+    if (!m_TimerStarted) {
+        Lock lock(m_TimerMutex);
+        if (m_TimerStop) {
+            return handle;
+        }
+        if (!m_TimerStarted) {
+            m_TimerThread = std::thread(&AsyncTask::TimerLoop, this);
+            m_TimerStarted = true;
+        }
+    }
+    if (m_TimerStop) {
+        return handle;
+    }
+    auto node = std::make_shared<TimerNode>();
+    node->m_Task = std::move(task);
+    node->m_DueTick = TickOf(due);
+    node->m_PeriodTicks = static_cast<uint64_t>(period.count());
+    node->m_Self = node;
+    handle.m_Node = node;
+    PushTimer(node.get());
+    return handle;
+}
+
+uint64_t AsyncTask::TickOf(std::chrono::steady_clock::time_point time) const {
+    if (time <= m_TimerEpoch) {
+        return 0;
+    }
+    return static_cast<uint64_t>(std::chrono::ceil<std::chrono::milliseconds>(time - m_TimerEpoch).count());
+}
+
+void AsyncTask::PushTimer(TimerNode* node) {
+    const uint64_t due = node->m_DueTick;
+    TimerNode* head = m_TimerInbox.load(std::memory_order_relaxed);
+    do {
+        node->m_Next = head;
+    } while (!m_TimerInbox.compare_exchange_weak(head, node));
+    // Only the submitter that moves the wake up tick earlier wakes the timer thread, the others are covered by it.
+    uint64_t wake = m_TimerWake.load();
+    while (due < wake) {
+        if (m_TimerWake.compare_exchange_weak(wake, due)) {
+            { Lock lock(m_TimerMutex); }
+            m_TimerCondition.notify_one();
+            break;
+        }
+    }
+}
+
+void AsyncTask::TimerLoop() {
+    while (!m_TimerStop) {
+        const auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_TimerEpoch).count());
+        if (m_WheelCount == 0) {
+            m_WheelTick = std::max(m_WheelTick, now);
+        }
+        TimerNode* node = m_TimerInbox.exchange(nullptr);
+        while (node) {
+            TimerNode* next = node->m_Next;
+            InsertTimer(node);
+            node = next;
+        }
+        while (m_WheelTick < now) {
+            ++m_WheelTick;
+            AdvanceWheel();
+        }
+        const uint64_t next = NextWheelEvent();
+        // Published before the inbox is checked again, see PushTimer.
+        m_TimerWake = next;
+        Lock lock(m_TimerMutex);
+        auto ready = [this]() { return m_TimerStop || m_TimerInbox.load() != nullptr; };
+        if (next == UINT64_MAX) {
+            m_TimerCondition.wait(lock, ready);
+        } else {
+            m_TimerCondition.wait_until(lock, m_TimerEpoch + std::chrono::milliseconds(next), ready);
+        }
+    }
+}
+
+void AsyncTask::InsertTimer(TimerNode* node) {
+    if (node->m_State == TimerNode::CANCELLED) {
+        ReleaseTimer(node);
+        return;
+    }
+    if (node->m_DueTick <= m_WheelTick) {
+        FireTimer(node);
+        return;
+    }
+    // The lowest level whose span covers the delay. A node due beyond the last level goes to its farthest slot and is
+    // filed again when that slot comes up.
+    const uint64_t delta = node->m_DueTick - m_WheelTick;
+    size_t level = 0;
+    while (level + 1 < WHEEL_LEVELS && delta >= (uint64_t(1) << (WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    const uint64_t target = std::min(node->m_DueTick, m_WheelTick + (uint64_t(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+    TimerNode*& slot = m_Wheel[level][(target >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    node->m_Next = slot;
+    slot = node;
+    ++m_WheelCount;
+}
+
+void AsyncTask::AdvanceWheel() {
+    for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+        const size_t shift = WHEEL_BITS * level;
+        if ((m_WheelTick & ((uint64_t(1) << shift) - 1)) != 0) {
+            break;
+        }
+        TimerNode* node = std::exchange(m_Wheel[level][(m_WheelTick >> shift) & (WHEEL_SLOTS - 1)], nullptr);
+        while (node) {
+            TimerNode* next = node->m_Next;
+            --m_WheelCount;
+            InsertTimer(node);
+            node = next;
+        }
+    }
+    TimerNode* node = std::exchange(m_Wheel[0][m_WheelTick & (WHEEL_SLOTS - 1)], nullptr);
+    while (node) {
+        TimerNode* next = node->m_Next;
+        --m_WheelCount;
+        FireTimer(node);
+        node = next;
+    }
+}
+
+uint64_t AsyncTask::NextWheelEvent() const {
+    if (m_WheelCount == 0) {
+        return UINT64_MAX;
+    }
+    // The next busy level 0 slot of this round, else the end of the round where the higher levels move down.
+    const uint64_t round = (m_WheelTick | (WHEEL_SLOTS - 1)) + 1;
+    for (uint64_t tick = m_WheelTick + 1; tick < round; ++tick) {
+        if (m_Wheel[0][tick & (WHEEL_SLOTS - 1)]) {
+            return tick;
+        }
+    }
+    return round;
+}
+
+void AsyncTask::FireTimer(TimerNode* node) {
+    if (node->m_PeriodTicks != 0) {
+        if (node->m_State == TimerNode::CANCELLED) {
+            ReleaseTimer(node);
+            return;
+        }
+        // The task owns the node while it runs, so a dropped task releases it.
+        Post([this, self = std::move(node->m_Self)]() mutable { RunPeriodic(std::move(self)); });
+        return;
+    }
+    int state = TimerNode::WAITING;
+    if (node->m_State.compare_exchange_strong(state, TimerNode::FIRED)) {
+        Post(std::move(node->m_Task));
+    }
+    ReleaseTimer(node);
+}
+
+void AsyncTask::RunPeriodic(std::shared_ptr<TimerNode> node) {
+    if (node->m_State == TimerNode::CANCELLED) {
+        return;
+    }
+    try {
+        node->m_Task();
+    } catch (...) {
+    }
+    if (node->m_State == TimerNode::CANCELLED || m_TimerStop) {
+        return;
+    }
+    // Skip the periods missed while the task was queued or running.
+    const auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_TimerEpoch).count());
+    if (node->m_DueTick + node->m_PeriodTicks <= now) {
+        node->m_DueTick += (now - node->m_DueTick) / node->m_PeriodTicks * node->m_PeriodTicks;
+    }
+    node->m_DueTick += node->m_PeriodTicks;
+    TimerNode* raw = node.get();
+    raw->m_Self = std::move(node);
+    PushTimer(raw);
+}
+
+void AsyncTask::ReleaseTimer(TimerNode* node) {
+    std::shared_ptr<TimerNode> self = std::move(node->m_Self);
+}
+
+void AsyncTask::StopTimer() {
+    {
+        Lock lock(m_TimerMutex);
+        m_TimerStop = true;
+    }
+    m_TimerCondition.notify_one();
+    // m_TimerThread is not touched once m_TimerStop is set.
+    if (m_TimerThread.joinable()) {
+        m_TimerThread.join();
+    }
+}
+
+void AsyncTask::ClearTimers() {
+    TimerNode* node = m_TimerInbox.exchange(nullptr);
+    while (node) {
+        TimerNode* next = node->m_Next;
+        ReleaseTimer(node);
+        node = next;
+    }
+    for (auto& level : m_Wheel) {
+        for (TimerNode*& slot : level) {
+            node = std::exchange(slot, nullptr);
+            while (node) {
+                TimerNode* next = node->m_Next;
+                ReleaseTimer(node);
+                node = next;
+            }
+        }
+    }
+    m_WheelCount = 0;
+}
+
+void AsyncTask::Execute(Job& job) {
+    AsyncTask* executing = s_ExecutingPool;
+    s_ExecutingPool = this;
+#if ASYNCTASK_TRACE
+    const uint64_t parent = s_TraceTask;
+    if (job.m_TraceId != 0) {
+        Record(TRACE_START, job);
+    }
+    s_TraceTask = job.m_TraceId;
+#endif
+#if ASYNCTASK_STATS
+    const auto start = std::chrono::steady_clock::now();
+#endif
+    try {
+        job.m_Task();
+    } catch (...) {
+    }
+    s_ExecutingPool = executing;
+#if ASYNCTASK_TRACE
+    // Ends what was started even if tracing stopped meanwhile.
+    if (job.m_TraceId != 0) {
+        Record(TRACE_END, job);
+    }
+    s_TraceTask = parent;
+#endif
+#if ASYNCTASK_STATS
+    const auto wait = static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(start - job.m_Queued).count(), 0));
+    const auto run = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    Counters& counters = CurrentCounters();
+    counters.Add(counters.m_Executed, 1);
+    counters.Add(counters.m_WaitNanos, wait);
+    counters.Add(counters.m_RunNanos, run);
+    counters.Add(counters.m_WaitHistogram[Bucket(wait)], 1);
+    counters.Add(counters.m_RunHistogram[Bucket(run)], 1);
+#endif
+    // Release the captures before anybody waiting on the task is woken.
+    job.m_Task = nullptr;
+    FinishJob(job);
+    FinishTasks(1);
+}
+
+bool AsyncTask::RunPendingTask() {
+    Job job;
+    if (s_CurrentPool == this) {
+        if (!FindTask(s_CurrentWorker->m_Index, job)) {
+            return false;
+        }
+    } else if (!PopUrgent(job) && !PopShared(job) && !Steal(m_Workers.size(), job) && !PopNodes(0, job) && !PopLane(DEADLINE_LANE, job) &&
+               !PopLane(LOW_LANE, job)) {
+        return false;
+    }
+    Execute(job);
+    return true;
+}
+
+template <typename Predicate>
+void AsyncTask::HelpUntil(std::mutex& mutex, std::condition_variable& condition, Predicate done) {
+    auto backoff = HELP_BACKOFF_MIN;
+    Lock lock(mutex);
+    while (!done()) {
+        lock.unlock();
+        const bool ran = RunPendingTask();
+        lock.lock();
+        if (ran) {
+            backoff = HELP_BACKOFF_MIN;
+        } else if (!condition.wait_for(lock, backoff, done)) {
+            // Nothing to run yet, but a running task may still queue the work we are waiting for.
+            backoff = std::min(backoff * 2, HELP_BACKOFF_MAX);
+        }
+    }
+    // done() was last checked with the lock held, so whoever made it true is done with mutex and condition.
+}
+
+void AsyncTask::WaitForComplete() {
+    const bool inside = s_ExecutingPool == this;
+    if (inside) {
+        ++m_WaitingTasks;
+    }
+    HelpUntil(m_Mutex, m_Condition, [this] { return m_PendingTasks.load() <= m_WaitingTasks.load(); });
+    if (inside) {
+        --m_WaitingTasks;
+    }
+}
+
+TaskGroup::TaskGroup(AsyncTask& pool) noexcept : m_Pool(pool), m_Pending(0) {
+}
+
+TaskGroup::~TaskGroup() {
+    Wait();
+}
+
+template <typename Iterator>
+void AsyncTask::AddTasks(TaskGroup& group, Iterator first, Iterator last) {
+    std::vector<Job> jobs;
+    jobs.reserve(static_cast<size_t>(std::distance(first, last)));
+    for (; first != last; ++first) {
+        jobs.emplace_back(Job{Task(std::move(*first)), &group});
+    }
+    group.m_Pending += jobs.size();
+    SubmitBatch(jobs);
+}
+
+template <typename Generator>
+void AsyncTask::AddTasks(TaskGroup& group, size_t count, Generator&& generator) {
+    std::vector<Job> jobs;
+    jobs.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        jobs.emplace_back(Job{Task(generator(i)), &group});
+    }
+    group.m_Pending += count;
+    SubmitBatch(jobs);
+}
+
+void TaskGroup::AddTask(TaskFunction&& task) {
+    m_Pool.AddTask(*this, std::move(task));
+}
+
+void TaskGroup::Wait() {
+    m_Pool.HelpUntil(m_Mutex, m_Condition, [this] { return m_Pending.load() == 0; });
+}
+
+void TaskGroup::Finish(size_t count) {
+    size_t pending = m_Pending.load();
+    while (pending > count) {
+        if (m_Pending.compare_exchange_weak(pending, pending - count)) {
+            return;
+        }
+    }
+    // The last one drops the counter with the lock held, otherwise Wait could return and the group be destroyed
+    // before we are done notifying.
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Pending -= count;
+    m_Condition.notify_all();
+#if defined(__cpp_impl_coroutine)
+    if (m_Pending.load() == 0 && !m_Continuations.empty()) {
+        // The resumed coroutines may destroy the group, do not touch it after unlocking.
+        std::vector<std::coroutine_handle<>> continuations = std::move(m_Continuations);
+        m_Continuations.clear();
+        AsyncTask& pool = m_Pool;
+        lock.unlock();
+        for (auto handle : continuations) {
+            pool.AddTask(CoroutineResumer(handle));
+        }
+    }
+#endif
+}
+
+#if defined(__cpp_impl_coroutine)
+void TaskGroup::Spawn(CoTask&& task) {
+    auto handle = std::exchange(task.m_Handle, nullptr);
+    handle.promise().m_Group = this;
+    ++m_Pending;
+    m_Pool.AddTask(CoroutineResumer(handle));
+}
+
+bool TaskGroup::Awaiter::await_ready() const {
+    std::lock_guard<std::mutex> guard(m_Group.m_Mutex);
+    return m_Group.m_Pending.load() == 0;
+}
+
+bool TaskGroup::Awaiter::await_suspend(std::coroutine_handle<> handle) const {
+    std::lock_guard<std::mutex> guard(m_Group.m_Mutex);
+    if (m_Group.m_Pending.load() == 0) {
+        return false;
+    }
+    m_Group.m_Continuations.push_back(handle);
+    return true;
+}
+#endif
+
+// The original one-shot behaviour on top of the long-lived pool: the threads serve one batch of tasks, WaitForComplete
+// waits for it and then shuts the pool down, tasks added after that are dropped.
+class OneShotAsyncTask {
+public:
+    OneShotAsyncTask(size_t maxthread = std::thread::hardware_concurrency()) noexcept : m_Pool(maxthread) {
+    }
+
+    ~OneShotAsyncTask() {
+        WaitForComplete();
+    }
+
+    inline size_t MaxConcurrency() {
+        return m_Pool.MaxConcurrency();
+    }
+
+    inline explicit operator bool() {
+        return static_cast<bool>(m_Pool);
+    }
+
+    inline void AddTask(TaskFunction&& task) {
+        m_Pool.AddTask(std::move(task));
+    }
+
+    inline void Shutdown(bool force = false) {
+        m_Pool.Shutdown(force);
+    }
+
+    inline void WaitForComplete() {
+        m_Pool.WaitForComplete();
+        m_Pool.Shutdown();
+    }
+
+private:
+    AsyncTask m_Pool;
+};
+
+/*  Examples:
+    {
+        Utils::AsyncTask pool;
+        Utils::ParallelFor(pool, size_t(0), v.size(), [&v](size_t i) { v[i] *= 2; });
+        auto sum = Utils::ParallelReduce(pool, size_t(0), v.size(), 0.0, [&v](double acc, size_t i) { return acc + v[i]; },
+                                         std::plus<double>());
+        Utils::ParallelTransform(pool, v.begin(), v.end(), out.begin(), [](double x) { return x * x; });
+        Utils::ParallelInclusiveScan(pool, v.begin(), v.end(), out.begin(), std::plus<double>());
+    }
+    grain is the largest range run as one task, 0 picks about eight ranges per thread. The calling thread takes part in
+    the work, and so do Tasks calling them from inside the pool.
+*/
+
+// Keeps values written by different threads on different cache lines.
+template <typename T>
+struct alignas(64) CacheAligned {
+    T m_Value;
+};
+
+namespace Parallel {
+
+template <typename Index>
+Index DefaultGrain(AsyncTask& pool, Index count, size_t grain) {
+    if (grain == 0) {
+        grain = static_cast<size_t>(count) / (pool.MaxConcurrency() * 8);
+    }
+    return static_cast<Index>(std::max<size_t>(grain, 1));
+}
+
+// Splits [begin, end) in halves, queues the upper ones and keeps the lowest for the calling thread. The halves queued
+// by a worker land in its own deque, so idle workers steal the largest pending ranges first.
+template <typename Index, typename RangeBody>
+void SplitRange(TaskGroup& group, Index begin, Index end, Index grain, const RangeBody& body) {
+    while (end - begin > grain) {
+        Index middle = begin + (end - begin) / 2;
+        group.AddTask([&group, middle, end, grain, &body]() { SplitRange(group, middle, end, grain, body); });
+        end = middle;
+    }
+    body(begin, end);
+}
+
+template <typename Index, typename RangeBody>
+void ForRange(AsyncTask& pool, Index begin, Index end, Index grain, const RangeBody& body) {
+    if (end <= begin) {
+        return;
+    }
+    TaskGroup group(pool);
+    SplitRange(group, begin, end, grain, body);
+    group.Wait();
+}
+
+}  // namespace Parallel
+
+/// \brief Calls body(i) for every i in [begin, end).
+template <typename Index, typename Body>
+void ParallelFor(AsyncTask& pool, Index begin, Index end, const Body& body, size_t grain = 0) {
+    const Index step = Parallel::DefaultGrain(pool, end - begin, grain);
+    Parallel::ForRange(pool, begin, end, step, [&body](Index first, Index last) {
+        for (Index i = first; i < last; ++i) {
+            body(i);
+        }
+    });
+}
+
+/// \brief Folds [begin, end) with accumulate(T, Index) into per-range partials starting at identity, then combines the
+/// partials in index order. The ranges only depend on the length and grain, so the result is the same from run to run
+/// even for non-associative operations such as floating-point sums. The default grain of 0 derives the ranges from
+/// pool.MaxConcurrency() too, pass an explicit grain for the same result on pools of different sizes.
+template <typename Index, typename T, typename Accumulate, typename Combine>
+T ParallelReduce(AsyncTask& pool, Index begin, Index end, T identity, const Accumulate& accumulate, const Combine& combine, size_t grain = 0) {
+    if (end <= begin) {
+        return identity;
+    }
+    const Index step = Parallel::DefaultGrain(pool, end - begin, grain);
+    const size_t chunks = static_cast<size_t>((end - begin + step - 1) / step);
+    std::vector<CacheAligned<T>> partials(chunks, CacheAligned<T>{identity});
+    Parallel::ForRange(pool, size_t(0), chunks, size_t(1), [&](size_t first, size_t last) {
+        for (size_t chunk = first; chunk < last; ++chunk) {
+            const Index from = begin + static_cast<Index>(chunk) * step;
+            const Index to = end - from > step ? from + step : end;
+            T value = identity;
+            for (Index i = from; i < to; ++i) {
+                value = accumulate(value, i);
+            }
+            partials[chunk].m_Value = std::move(value);
+        }
+    });
+    T result = std::move(identity);
+    for (auto& partial : partials) {
+        result = combine(result, partial.m_Value);
+    }
+    return result;
+}
+
+/// \brief out[i] = op(first[i]) for every element, both sides must be random access iterators.
+template <typename InputIt, typename OutputIt, typename UnaryOp>
+OutputIt ParallelTransform(AsyncTask& pool, InputIt first, InputIt last, OutputIt out, const UnaryOp& op, size_t grain = 0) {
+    const auto count = static_cast<size_t>(last - first);
+    ParallelFor(pool, size_t(0), count, [&first, &out, &op](size_t i) { out[i] = op(first[i]); }, grain);
+    return out + count;
+}
+
+/// \brief out[i] = first[0] op first[1] op ... op first[i], op must be associative. Two passes over the input, the first
+/// sums up each range, the second scans each range starting from the sum of the ranges before it.
+template <typename InputIt, typename OutputIt, typename BinaryOp>
+OutputIt ParallelInclusiveScan(AsyncTask& pool, InputIt first, InputIt last, OutputIt out, const BinaryOp& op, size_t grain = 0) {
+    using T = typename std::iterator_traits<InputIt>::value_type;
+    const auto count = static_cast<size_t>(last - first);
+    if (count == 0) {
+        return out;
+    }
+    const size_t step = Parallel::DefaultGrain(pool, count, grain);
+    const size_t chunks = (count + step - 1) / step;
+    if (chunks == 1) {
+        return std::partial_sum(first, last, out, op);
+    }
+    // The last range's sum is never needed.
+    std::vector<CacheAligned<T>> sums(chunks - 1, CacheAligned<T>{T()});
+    Parallel::ForRange(pool, size_t(0), chunks - 1, size_t(1), [&](size_t from, size_t to) {
+        for (size_t chunk = from; chunk < to; ++chunk) {
+            auto it = first + chunk * step;
+            T value = *it;
+            for (auto end = it + step; ++it != end;) {
+                value = op(value, *it);
+            }
+            sums[chunk].m_Value = std::move(value);
+        }
+    });
+    for (size_t chunk = 1; chunk < chunks - 1; ++chunk) {
+        sums[chunk].m_Value = op(sums[chunk - 1].m_Value, sums[chunk].m_Value);
+    }
+    Parallel::ForRange(pool, size_t(0), chunks, size_t(1), [&](size_t from, size_t to) {
+        for (size_t chunk = from; chunk < to; ++chunk) {
+            const size_t begin = chunk * step;
+            const size_t end = std::min(begin + step, count);
+            T value = chunk == 0 ? first[begin] : op(sums[chunk - 1].m_Value, first[begin]);
+            out[begin] = value;
+            for (size_t i = begin + 1; i < end; ++i) {
+                value = op(value, first[i]);
+                out[i] = value;
+            }
+        }
+    });
+    return out + count;
+}
+
+/*  Examples:
+    {
+        Utils::AsyncTask pool;
+        Utils::TaskGraph graph(pool);
+        auto load = graph.AddNode([](){ ... });
+        auto left = graph.AddNode([](){ ... });
+        auto right = graph.AddNode([](){ ... });
+        auto merge = graph.AddNode([](){ ... });
+        graph.Precede(load, left);
+        graph.Precede(load, right);
+        graph.Precede(left, merge);
+        graph.Precede(right, merge);
+        graph.Run();
+        graph.Wait();   // Run and Wait can be repeated, the graph is kept.
+    }
+*/
+/// Tasks with ordering constraints. A node becomes runnable when the counter of its unfinished predecessors drops to
+/// zero, the worker finishing the last predecessor runs it right away or queues it in its own deque, so no stage waits
+/// on a barrier.
+class TaskGraph {
+public:
+    using NodeId = size_t;
+
+    explicit TaskGraph(AsyncTask& pool) noexcept : m_Group(pool) {
+    }
+
+    /// \brief Blocked here by Wait.
+    ~TaskGraph() {
+        Wait();
+    }
+
+    /// \brief Add a node, the task is kept and runs once per Run.
+    NodeId AddNode(TaskFunction&& task) {
+        m_Nodes.emplace_back(std::make_unique<Node>());
+        m_Nodes.back()->m_Task = std::move(task);
+        return m_Nodes.size() - 1;
+    }
+
+    /// \brief The node after starts only when the node before is finished. Do not change the graph while it runs.
+    void Precede(NodeId before, NodeId after) {
+        assert(before < m_Nodes.size() && after < m_Nodes.size() && before != after);
+        m_Nodes[before]->m_Successors.push_back(m_Nodes[after].get());
+        ++m_Nodes[after]->m_Predecessors;
+    }
+
+    /// \brief Start the nodes without predecessors, the rest follow as their predecessors finish. Do not call it again
+    /// before Wait returns.
+    void Run() {
+        assert(IsAcyclic());
+        for (auto& node : m_Nodes) {
+            node->m_Remaining.store(node->m_Predecessors, std::memory_order_relaxed);
+        }
+        for (auto& node : m_Nodes) {
+            if (node->m_Predecessors == 0) {
+                Schedule(node.get());
+            }
+        }
+    }
+
+    /// \brief Idempotent. Wait for the nodes of the last Run, running queued tasks meanwhile.
+    void Wait() {
+        m_Group.Wait();
+    }
+
+private:
+    struct Node {
+        TaskFunction m_Task;
+        std::vector<Node*> m_Successors;
+        size_t m_Predecessors = 0;
+        std::atomic<size_t> m_Remaining{0};
+    };
+
+    void Schedule(Node* node) {
+        m_Group.AddTask([this, node]() { Execute(node); });
+    }
+
+    void Execute(Node* node) {
+        while (node) {
+            try {
+                node->m_Task();
+            } catch (...) {
+            }
+            // Continue with the first successor that became ready, queue the others on this worker.
+            Node* next = nullptr;
+            for (Node* successor : node->m_Successors) {
+                if (successor->m_Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    if (next) {
+                        Schedule(next);
+                    }
+                    next = successor;
+                }
+            }
+            node = next;
+        }
+    }
+
+    bool IsAcyclic() const {
+        std::vector<size_t> remaining(m_Nodes.size());
+        std::vector<const Node*> ready;
+        std::unordered_map<const Node*, size_t> index;
+        for (size_t i = 0; i < m_Nodes.size(); ++i) {
+            remaining[i] = m_Nodes[i]->m_Predecessors;
+            index[m_Nodes[i].get()] = i;
+            if (remaining[i] == 0) {
+                ready.push_back(m_Nodes[i].get());
+            }
+        }
+        size_t visited = 0;
+        while (!ready.empty()) {
+            const Node* node = ready.back();
+            ready.pop_back();
+            ++visited;
+            for (const Node* successor : node->m_Successors) {
+                if (--remaining[index[successor]] == 0) {
+                    ready.push_back(successor);
+                }
+            }
+        }
+        return visited == m_Nodes.size();
+    }
+
+    TaskGraph(const TaskGraph& self) = delete;
+    TaskGraph& operator=(const TaskGraph& self) = delete;
+
+private:
+    std::vector<std::unique_ptr<Node>> m_Nodes;
+    TaskGroup m_Group;
+};
+
+/*  Examples:
+    {
+        Utils::AsyncTask pool;
+        Utils::Strand strand(pool);
+        // From any thread, no lock around the state the tasks share.
+        strand.AddTask([&state](){ state.Update(); });
+        strand.AddTask([&state](){ state.Flush(); });
+    } // Blocked here by Wait in dtor.
+*/
+/// Serial executor on a pool: the tasks added to a strand run one at a time, in the order they were added, on whatever
+/// worker is free. Producers push to a lock-free queue, and only the push that finds the strand idle schedules a task on
+/// the pool, which then runs up to batch queued tasks before handing the strand over.
+class Strand {
+public:
+    static constexpr size_t DEFAULT_BATCH = 64;
+
+    explicit Strand(AsyncTask& pool, size_t batch = DEFAULT_BATCH) noexcept
+        : m_Batch(std::max<size_t>(batch, 1)), m_Count(0), m_Head(&m_Stub), m_Tail(&m_Stub), m_Group(pool) {
+    }
+
+    /// \brief Blocked here by Wait. The tasks that never ran, because the pool was shut down, are destroyed here.
+    ~Strand() {
+        Wait();
+        // Nothing drains the strand any more, only a shut-down pool leaves tasks behind.
+        for (; m_Count.load() != 0; m_Count.fetch_sub(1)) {
+            delete Pop();
+        }
+    }
+
+    /// \brief Add new task to the strand. Can called from any thread, including the tasks of this strand. Once the pool
+    /// is shut down, the tasks that have not started yet and the ones added afterwards never run, they are dropped when
+    /// the strand is destroyed.
+    void AddTask(TaskFunction&& task) {
+        Node* node = new Node;
+        node->m_Task = std::move(task);
+        Push(node);
+        if (m_Count.fetch_add(1, std::memory_order_acq_rel) == 0) {
+            m_Group.AddTask([this]() { Drain(); });
+        }
+    }
+
+    /// \brief Idempotent. Wait for the tasks added so far, running queued tasks of the pool meanwhile.
+    void Wait() {
+        m_Group.Wait();
+    }
+
+    /// \brief Whether the calling thread is running a task of this strand.
+    bool RunningInThisThread() const {
+        return s_Current == this;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> m_Next{nullptr};
+        TaskFunction m_Task;
+    };
+
+    // Multi-producer single-consumer intrusive queue (Dmitry Vyukov's), a push is one exchange and never waits.
+    void Push(Node* node) {
+        node->m_Next.store(nullptr, std::memory_order_relaxed);
+        Node* previous = m_Head.exchange(node, std::memory_order_acq_rel);
+        previous->m_Next.store(node, std::memory_order_release);
+    }
+
+    // Only called by the draining task while m_Count says a node is queued. Spins while its producer is between the
+    // two steps of Push.
+    Node* Pop() {
+        while (true) {
+            Node* tail = m_Tail;
+            Node* next = tail->m_Next.load(std::memory_order_acquire);
+            if (tail == &m_Stub) {
+                if (!next) {
+                    CpuRelax();
+                    continue;
+                }
+                m_Tail = next;
+                tail = next;
+                next = next->m_Next.load(std::memory_order_acquire);
+            }
+            if (next) {
+                m_Tail = next;
+                return tail;
+            }
+            if (tail == m_Head.load(std::memory_order_acquire)) {
+                // tail is the last node, put the stub behind it so it can be taken.
+                Push(&m_Stub);
+                next = tail->m_Next.load(std::memory_order_acquire);
+                if (next) {
+                    m_Tail = next;
+                    return tail;
+                }
+            }
+            CpuRelax();
+        }
+    }
+
+    void Drain() {
+        const Strand* previous = s_Current;
+        s_Current = this;
+        for (size_t done = 0; done < m_Batch; ++done) {
+            Node* node = Pop();
+            try {
+                node->m_Task();
+            } catch (...) {
+            }
+            delete node;
+            // The strand is idle again, the next AddTask schedules it.
+            if (m_Count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                s_Current = previous;
+                return;
+            }
+        }
+        s_Current = previous;
+        // More are queued: continue in a new task, so a busy strand does not keep its worker from the rest of the pool.
+        m_Group.AddTask([this]() { Drain(); });
+    }
+
+    Strand(const Strand& self) = delete;
+    Strand& operator=(const Strand& self) = delete;
+
+private:
+    static thread_local const Strand* s_Current;
+
+    const size_t m_Batch;
+    // Queued tasks, the strand is scheduled on the pool while it is not zero.
+    std::atomic<size_t> m_Count;
+    // Producers and the consumer work on different cache lines.
+    alignas(64) std::atomic<Node*> m_Head;
+    alignas(64) Node* m_Tail;
+    Node m_Stub;
+    // Destroyed first, so the draining task is done before the queue goes.
+    TaskGroup m_Group;
+};
+
+thread_local const Strand* Strand::s_Current = nullptr;
+
+}  // namespace Utils
+
+namespace AsynTask_T {
+
+using namespace Utils;
+void Run(std::atomic_int& value) {
+    std::default_random_engine engine(
+        static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()));
+    int random = engine();
+    value += random;
+    std::this_thread::sleep_for(std::chrono::milliseconds(random % 100));
+    value -= random;
+}
+
+struct Functor {
+    Functor(std::atomic_int& value) : m_value(value) {
+    }
+
+    Functor(const Functor& f) : m_value(f.m_value) {
+    }
+
+    void operator()() {
+        Run(m_value);
+    }
+
+    void operator()(std::atomic_int& value) {
+        Run(value);
+    }
+
+    void Method() {
+        Run(m_value);
+    }
+
+    void Method(std::atomic_int& value) {
+        Run(value);
+    }
+
+private:
+    std::atomic_int& m_value;
+};
+
+void NormalFunc(std::atomic_int& value) {
+    Run(value);
+}
+
+static std::atomic_int g_value = 0;
+void Function() {
+    Run(g_value);
+}
+
+// case: Idempotent
+void TCase0() {
+    auto start = std::chrono::system_clock::now();
+    auto sleep_time = 10000;
+    {
+        Utils::AsyncTask at;
+        at.AddTask([sleep_time]() {
+            Function();
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
+            Run(g_value);
+        });
+        at.WaitForComplete();
+        at.WaitForComplete();
+        at.WaitForComplete();
+        at.WaitForComplete();
+    }
+    assert(g_value.load() == 0);
+    auto elapse = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count();
+    assert(elapse >= sleep_time);
+}
+
+// case: functor
+void TCase1() {
+    std::atomic_int value = 0;
+    {
+        Utils::AsyncTask at;
+        at.AddTask(Functor{value});
+    }
+    assert(value.load() == 0);
+}
+
+// case: normal function
+void TCase2() {
+    {
+        Utils::AsyncTask at;
+        at.AddTask(Function);
+    }
+    assert(g_value.load() == 0);
+}
+
+// case: std::bind (deprecated since C++ 17, to be removed)
+void TCase3() {
+    std::atomic_int value = 0;
+    {
+        Utils::AsyncTask at;
+        at.AddTask(std::bind(NormalFunc, std::ref(value)));
+        Functor functor{value};
+        at.AddTask(std::bind(static_cast<void (Functor::*)()>(&Functor::operator()), &functor));
+        at.AddTask(std::bind(static_cast<void (Functor::*)()>(&Functor::Method), &functor));
+        at.AddTask(std::bind(static_cast<void (Functor::*)(std::atomic_int&)>(&Functor::operator()), &functor, std::ref(value)));
+        at.AddTask(std::bind(static_cast<void (Functor::*)(std::atomic_int&)>(&Functor::Method), &functor, std::ref(value)));
+    }
+    assert(value.load() == 0);
+}
+
+// case: lambda
+void TCase4() {
+    std::atomic_int value = 0;
+    {
+        Utils::AsyncTask at;
+        at.AddTask([&value]() {
+            Functor functor{value};
+            functor.operator()(value);
+        });
+    }
+    assert(value.load() == 0);
+}
+
+// case: nested fan-out, tasks added from tasks go to the worker's own queue and get stolen by the others
+void TCase5() {
+    std::atomic_int count = 0;
+    std::function<void(Utils::AsyncTask&, int)> fan_out = [&fan_out, &count](Utils::AsyncTask& at, int depth) {
+        ++count;
+        if (depth == 0) {
+            return;
+        }
+        for (auto i = 0; i < 4; ++i) {
+            at.AddTask([&fan_out, &at, depth]() { fan_out(at, depth - 1); });
+        }
+    };
+    {
+        Utils::AsyncTask at;
+        at.AddTask([&fan_out, &at]() { fan_out(at, 8); });
+    }
+    // 1 + 4 + 16 + ... + 4^8
+    assert(count.load() == ((1 << 18) - 1) / 3);
+}
+
+// case: functionality (a little intricate)
+void TCase6() {
+    std::atomic_int value = 0;
+    {
+        auto test_task = [](Utils::AsyncTask& at, std::atomic_int& value, int times) {
+            static auto worker = [](std::atomic_int& value) {
+                Functor functor{value};
+                functor();
+                functor.operator()(value);
+                functor.Method();
+                functor.Method(value);
+                NormalFunc(value);
+                Function();
+            };
+
+            static auto lambda0 = [&at, &value, times]() { at.AddTask([&at, &value, times]() { worker(value); }); };
+
+            static auto lambda1 = [&at, &value, times]() {
+                worker(value);
+                int tmp = times;
+                while (tmp-- > 0) {
+                    at.AddTask(lambda0);
+                }
+                worker(value);
+            };
+            static auto lambda2 = [&at, &value, times]() {
+                worker(value);
                 int tmp = times;
                 while (tmp-- > 0) {
                     at.AddTask(lambda1);
@@ -371,106 +3523,1294 @@ void TCase6() {
                 worker(value);
             };
 
-            lambda9();
-        };
+            lambda9();
+        };
+
+        Utils::AsyncTask at;
+        at.AddTask([&test_task, &at, &value]() { test_task(at, value, 2); });
+    }
+    assert(value.load() == 0);
+    assert(g_value.load() == 0);
+}
+
+// case: functionality (a little intricate)
+void TCase7() {
+    std::atomic_int value = 0;
+    {
+        auto test_task = [](Utils::AsyncTask& at, std::atomic_int& value, int times) {
+            static auto worker = [](std::atomic_int& value) {
+                Functor functor{value};
+                functor();
+                functor.operator()(value);
+                functor.Method();
+                functor.Method(value);
+                NormalFunc(value);
+                Function();
+            };
+
+            static auto lambda0 = [&at, &value, times]() { at.AddTask([&at, &value, times]() { worker(value); }); };
+
+#define DEF_LAMBDA(at, value, times, num, prev)        \
+    static auto lambda##num = [&at, &value, times]() { \
+        worker(value);                                 \
+        int tmp = times;                               \
+        while (tmp-- > 0) {                            \
+            at.AddTask(lambda##prev);                  \
+        }                                              \
+        worker(value);                                 \
+    };
+
+            DEF_LAMBDA(at, value, times, 1, 0);
+            DEF_LAMBDA(at, value, times, 2, 1);
+            DEF_LAMBDA(at, value, times, 3, 2);
+            DEF_LAMBDA(at, value, times, 4, 3);
+            DEF_LAMBDA(at, value, times, 5, 4);
+            DEF_LAMBDA(at, value, times, 6, 5);
+            DEF_LAMBDA(at, value, times, 7, 6);
+            DEF_LAMBDA(at, value, times, 8, 7);
+            DEF_LAMBDA(at, value, times, 9, 8);
+
+            lambda9();
+        };
+
+        Utils::AsyncTask at;
+        at.AddTask([&test_task, &at, &value]() { test_task(at, value, 2); });
+    }
+    assert(value.load() == 0);
+    assert(g_value.load() == 0);
+}
+
+// case: Performance
+#pragma warning(disable : 4996 4244)
+void TCase8() {
+    auto lambda = [](int times, int loop) {
+        constexpr int PI_LEN = 1024;
+        char* result_pi = new char[times * PI_LEN]{};
+        {
+            auto calculate_pi = [](char* pi) {
+                int a = 1e4, c = 3e3, b = c, d = 0, e = 0, f[3000], g = 1, h = 0;
+                do {
+                    if (!--b) {
+                        sprintf(pi, "%04d", e + d / a), e = d % a, h = b = c -= 15;
+                        pi += 4;
+                    } else {
+                        f[b] = (d = d / g * b + a * (h ? f[b] : 2e3)) % (g = b * 2 - 1);
+                    }
+                } while (b);
+            };
+            Utils::AsyncTask at;
+            for (auto i = 0; i < times; ++i) {
+                at.AddTask([&calculate_pi, buf{result_pi + i * PI_LEN}, loop]() {
+                    for (auto i = 0; i < loop; i++) {
+                        calculate_pi(buf);
+                    }
+                });
+            }
+        }
+        for (auto i = 1; i < times; ++i) {
+            assert(memcmp(result_pi, result_pi + i * PI_LEN, PI_LEN) == 0);
+        }
+        delete[] result_pi;
+    };
+    constexpr int LOOP = 2048;
+    for (auto i = 0; i < 32; ++i) {
+        auto start = std::chrono::system_clock::now();
+        lambda(i, LOOP);
+        auto elapse = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count();
+        std::cout << "Run " << i << " * " << LOOP << " tiems of PI computing takes: " << elapse << std::endl;
+    }
+}
+
+// case: concurrent producers from non-worker threads, more tasks than the shared ring holds
+void TCase9() {
+    constexpr int PRODUCERS = 16;
+    constexpr int TASKS = 1024;
+    std::atomic_int count = 0;
+    {
+        Utils::AsyncTask at;
+        // Keeps the pool from draining while the producers start.
+        at.AddTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+        std::vector<std::thread> producers;
+        for (auto i = 0; i < PRODUCERS; ++i) {
+            producers.emplace_back([&at, &count]() {
+                for (auto j = 0; j < TASKS; ++j) {
+                    at.AddTask([&count]() { ++count; });
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+    }
+    assert(count.load() == PRODUCERS * TASKS);
+}
+
+// case: move-only captures
+void TCase10() {
+    std::promise<int> promise;
+    std::future<int> future = promise.get_future();
+    auto value = std::make_unique<int>(42);
+    {
+        Utils::AsyncTask at;
+        at.AddTask([promise{std::move(promise)}, value{std::move(value)}]() mutable { promise.set_value(*value); });
+        // Too large for the inline buffer, goes to the heap.
+        char large[Utils::TaskFunction::INLINE_SIZE * 2] = {1};
+        at.AddTask([large, v{std::make_unique<int>(1)}]() { assert(large[0] == *v); });
+    }
+    assert(future.get() == 42);
+}
+
+// case: many batches on one long-lived pool, each group is waited for on its own
+void TCase11() {
+    Utils::AsyncTask at;
+    std::atomic_int total = 0;
+    for (auto batch = 0; batch < 1000; ++batch) {
+        std::atomic_int count = 0;
+        Utils::TaskGroup group(at);
+        for (auto i = 0; i < 8; ++i) {
+            group.AddTask([&group, &count]() {
+                ++count;
+                group.AddTask([&count]() { ++count; });
+            });
+        }
+        // Unrelated work in the same pool is not waited for by the group.
+        at.AddTask([&total]() { ++total; });
+        group.Wait();
+        assert(count.load() == 16);
+    }
+    at.WaitForComplete();
+    assert(total.load() == 1000);
+    assert(at);
+}
+
+// case: one-shot wrapper, the pool is gone after the first WaitForComplete
+void TCase12() {
+    std::atomic_int count = 0;
+    Utils::OneShotAsyncTask at;
+    at.AddTask([&count]() { ++count; });
+    at.WaitForComplete();
+    assert(!at);
+    at.AddTask([&count]() { ++count; });
+    at.WaitForComplete();
+    assert(count.load() == 1);
+}
+
+// case: elastic sizing, threads are started on demand and retired after the idle timeout
+void TCase13() {
+    Utils::AsyncTask::Policy policy;
+    policy.minthread = 1;
+    policy.maxthread = 4;
+    policy.idletimeout = std::chrono::milliseconds(50);
+    Utils::AsyncTask at(policy);
+    // Only the minimum is started up front.
+    assert(at.ThreadCount() == 1);
+
+    std::atomic_int count = 0;
+    std::promise<void> gate;
+    std::shared_future<void> opened = gate.get_future().share();
+    for (auto i = 0; i < 16; ++i) {
+        at.AddTask([opened, &count]() {
+            opened.wait();
+            ++count;
+        });
+    }
+    // Generous bound, more threads are started as the tasks hold the first one.
+    for (auto i = 0; i < 1000 && at.ThreadCount() < 4; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assert(at.ThreadCount() > 1 && at.ThreadCount() <= 4);
+    gate.set_value();
+    at.WaitForComplete();
+    assert(count.load() == 16);
+
+    // Generous bound, the idle threads retire 50ms after running out of work.
+    for (auto i = 0; i < 1000 && at.ThreadCount() > 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(at.ThreadCount() == 1);
+    // Still usable after the threads retired.
+    at.AddTask([&count]() { ++count; });
+    at.WaitForComplete();
+    assert(count.load() == 17);
+}
+
+// case: helping waits, recursive divide and conquer waiting on its own subtasks inside the pool
+void TCase14() {
+    std::function<long long(Utils::AsyncTask&, int, int)> sum = [&sum](Utils::AsyncTask& at, int begin, int end) -> long long {
+        if (end - begin <= 64) {
+            long long result = 0;
+            for (auto i = begin; i < end; ++i) {
+                result += i;
+            }
+            return result;
+        }
+        long long left = 0;
+        long long right = 0;
+        auto middle = begin + (end - begin) / 2;
+        Utils::TaskGroup group(at);
+        group.AddTask([&sum, &at, &left, begin, middle]() { left = sum(at, begin, middle); });
+        group.AddTask([&sum, &at, &right, middle, end]() { right = sum(at, middle, end); });
+        // Blocking here would deadlock with two threads, the waiting thread runs the subtasks instead.
+        group.Wait();
+        return left + right;
+    };
+
+    constexpr int N = 1 << 16;
+    Utils::AsyncTask at(2);
+    long long result = 0;
+    Utils::TaskGroup group(at);
+    group.AddTask([&sum, &at, &result]() { result = sum(at, 0, N); });
+    group.Wait();
+    assert(result == static_cast<long long>(N) * (N - 1) / 2);
+
+    // WaitForComplete from a task waits for the others.
+    std::atomic_int count = 0;
+    at.AddTask([&at, &count]() {
+        for (auto i = 0; i < 100; ++i) {
+            at.AddTask([&count]() { ++count; });
+        }
+        at.WaitForComplete();
+        assert(count.load() == 100);
+    });
+    at.WaitForComplete();
+    assert(count.load() == 100);
+}
+
+// case: parallel algorithms
+void TCase15() {
+    constexpr size_t N = 100000;
+    Utils::AsyncTask at;
+    std::vector<long long> values(N);
+    Utils::ParallelFor(at, size_t(0), N, [&values](size_t i) { values[i] = static_cast<long long>(i); });
+    for (size_t i = 0; i < N; ++i) {
+        assert(values[i] == static_cast<long long>(i));
+    }
+
+    auto sum = Utils::ParallelReduce(at, size_t(0), N, 0LL, [&values](long long acc, size_t i) { return acc + values[i]; }, std::plus<long long>());
+    assert(sum == static_cast<long long>(N) * (N - 1) / 2);
+    // Same partials whatever the scheduling, so floating-point sums are reproducible.
+    auto fsum = [&at, &values]() {
+        return Utils::ParallelReduce(at, size_t(0), N, 0.0, [&values](double acc, size_t i) { return acc + 1.0 / (values[i] + 1); }, std::plus<double>(), 100);
+    };
+    assert(fsum() == fsum());
+
+    std::vector<long long> squares(N);
+    Utils::ParallelTransform(at, values.begin(), values.end(), squares.begin(), [](long long x) { return x * x; });
+    for (size_t i = 0; i < N; ++i) {
+        assert(squares[i] == values[i] * values[i]);
+    }
+
+    std::vector<long long> scan(N);
+    std::vector<long long> expected(N);
+    std::partial_sum(values.begin(), values.end(), expected.begin());
+    for (size_t grain : {size_t(0), size_t(1), size_t(7), N}) {
+        Utils::ParallelInclusiveScan(at, values.begin(), values.end(), scan.begin(), std::plus<long long>(), grain);
+        assert(scan == expected);
+    }
+}
+
+// case: Performance, ParallelFor against one AddTask per index
+void TCase16() {
+    constexpr size_t N = 1 << 16;
+    std::vector<size_t> values(N, 0);
+    Utils::AsyncTask at;
+    for (size_t round = 0; round < 3; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        {
+            Utils::TaskGroup group(at);
+            for (size_t i = 0; i < N; ++i) {
+                group.AddTask([&values, i]() { values[i] += i; });
+            }
+        }
+        auto hand_rolled = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        Utils::ParallelFor(at, size_t(0), N, [&values](size_t i) { values[i] += 1; });
+        auto parallel_for = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Update " << N << " elements, AddTask per index takes: " << hand_rolled << "us, ParallelFor takes: " << parallel_for << "us" << std::endl;
+        // Both passes updated every element exactly once.
+        for (size_t i = 0; i < N; ++i) {
+            assert(values[i] == (round + 1) * (i + 1));
+        }
+    }
+}
+
+// case: task graph, a diamond repeated without barriers and a long chain
+void TCase17() {
+    Utils::AsyncTask at;
+    std::vector<int> order;
+    std::mutex mutex;
+    auto record = [&order, &mutex](int id) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(id);
+    };
+    {
+        Utils::TaskGraph graph(at);
+        auto load = graph.AddNode([&record]() { record(0); });
+        auto left = graph.AddNode([&record]() { record(1); });
+        auto right = graph.AddNode([&record]() { record(2); });
+        auto merge = graph.AddNode([&record]() { record(3); });
+        graph.Precede(load, left);
+        graph.Precede(load, right);
+        graph.Precede(left, merge);
+        graph.Precede(right, merge);
+        for (auto run = 0; run < 100; ++run) {
+            order.clear();
+            graph.Run();
+            graph.Wait();
+            assert(order.size() == 4 && order.front() == 0 && order.back() == 3);
+        }
+    }
+
+    std::atomic_int step = 0;
+    bool in_order = true;
+    {
+        Utils::TaskGraph graph(at);
+        Utils::TaskGraph::NodeId previous = 0;
+        for (auto i = 0; i < 1000; ++i) {
+            auto node = graph.AddNode([&step, &in_order, i]() { in_order = in_order && step.fetch_add(1) == i; });
+            if (i > 0) {
+                graph.Precede(previous, node);
+            }
+            previous = node;
+        }
+        graph.Run();
+    }
+    assert(in_order && step.load() == 1000);
+}
+
+#if defined(__cpp_impl_coroutine)
+Utils::CoTask SleepAndCount(Utils::AsyncTask& at, std::atomic_int& count, std::atomic_int& sleeping, std::atomic_int& peak) {
+    co_await at.Schedule();
+    const int now = ++sleeping;
+    for (int seen = peak.load(); now > seen && !peak.compare_exchange_weak(seen, now);) {
+    }
+    co_await at.SleepFor(std::chrono::milliseconds(50));
+    --sleeping;
+    Utils::TaskGroup group(at);
+    group.AddTask([&count]() { ++count; });
+    co_await group;
+    ++count;
+}
 
-        Utils::AsyncTask at;
-        at.AddTask([&test_task, &at, &value]() { test_task(at, value, 2); });
+// case: coroutines, a thousand sleeping operations share two threads
+void TCase18() {
+    std::atomic_int count = 0;
+    std::atomic_int sleeping = 0;
+    std::atomic_int peak = 0;
+    Utils::AsyncTask at(2);
+    {
+        Utils::TaskGroup group(at);
+        for (auto i = 0; i < 1000; ++i) {
+            group.Spawn(SleepAndCount(at, count, sleeping, peak));
+        }
     }
-    assert(value.load() == 0);
-    assert(g_value.load() == 0);
+    assert(count.load() == 2000 && sleeping.load() == 0);
+    // Blocking in sleep_for, no more than the two threads would sleep at once.
+    assert(peak.load() > 2);
 }
 
-// case: functionality (a little intricate)
-void TCase7() {
+Utils::CoTask CoRun(Utils::AsyncTask& at, std::atomic_int& value, int random) {
+    co_await at.Schedule();
+    value += random;
+    co_await at.SleepFor(std::chrono::milliseconds(random % 100));
+    value -= random;
+}
+
+// case: Performance, the sleeping Run() as blocking tasks against coroutines
+void TCase19() {
+    constexpr int TASKS = 256;
+    std::default_random_engine engine(static_cast<unsigned int>(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::vector<int> randoms(TASKS);
+    for (auto& random : randoms) {
+        random = static_cast<int>(engine() & 0xffff);
+    }
     std::atomic_int value = 0;
+    Utils::AsyncTask at;
+
+    auto start = std::chrono::steady_clock::now();
     {
-        auto test_task = [](Utils::AsyncTask& at, std::atomic_int& value, int times) {
-            static auto worker = [](std::atomic_int& value) {
-                Functor functor{value};
-                functor();
-                functor.operator()(value);
-                functor.Method();
-                functor.Method(value);
-                NormalFunc(value);
-                Function();
-            };
+        Utils::TaskGroup group(at);
+        for (auto random : randoms) {
+            group.AddTask([&value, random]() {
+                value += random;
+                std::this_thread::sleep_for(std::chrono::milliseconds(random % 100));
+                value -= random;
+            });
+        }
+    }
+    auto blocking = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
 
-            static auto lambda0 = [&at, &value, times]() { at.AddTask([&at, &value, times]() { worker(value); }); };
+    start = std::chrono::steady_clock::now();
+    {
+        Utils::TaskGroup group(at);
+        for (auto random : randoms) {
+            group.Spawn(CoRun(at, value, random));
+        }
+    }
+    auto coroutine = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    assert(value.load() == 0);
+    std::cout << "Run " << TASKS << " sleeping tasks on " << at.MaxConcurrency() << " threads, blocking takes: " << blocking
+              << ", coroutines take: " << coroutine << std::endl;
+}
+#endif
 
-#define DEF_LAMBDA(at, value, times, num, prev)        \
-    static auto lambda##num = [&at, &value, times]() { \
-        worker(value);                                 \
-        int tmp = times;                               \
-        while (tmp-- > 0) {                            \
-            at.AddTask(lambda##prev);                  \
-        }                                              \
-        worker(value);                                 \
+// case: timer wheel, ten thousand delayed tasks, cancellation and a periodic task
+void TCase20() {
+    Utils::AsyncTask at(4);
+    constexpr int TIMERS = 10000;
+    auto start = std::chrono::steady_clock::now();
+    std::atomic_int fired = 0;
+    std::atomic_bool early = false;
+    std::mt19937 engine(20);
+    std::uniform_int_distribution<int> distribution(0, 300);
+    for (auto i = 0; i < TIMERS; ++i) {
+        auto delay = std::chrono::milliseconds(distribution(engine));
+        at.AddDelayedTask(delay, [&fired, &early, start, delay]() {
+            early = early || std::chrono::steady_clock::now() - start < delay;
+            ++fired;
+        });
+    }
+
+    std::atomic_bool cancelled_ran = false;
+    auto cancelled = at.AddDelayedTask(std::chrono::milliseconds(100), [&cancelled_ran]() { cancelled_ran = true; });
+    const bool first_cancel = cancelled.Cancel();
+    const bool second_cancel = cancelled.Cancel();
+    assert(first_cancel && !second_cancel);
+    auto never = at.AddDelayedTask(std::chrono::hours(1), []() {});
+
+    std::atomic_int ticks = 0;
+    auto periodic = at.AddPeriodicTask(std::chrono::milliseconds(10), [&ticks]() { ++ticks; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    const bool periodic_cancelled = periodic.Cancel();
+    assert(periodic_cancelled);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const int stopped = ticks.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    at.WaitForComplete();
+    assert(fired.load() == TIMERS && !early.load());
+    const bool empty_cancelled = Utils::AsyncTask::TimerHandle().Cancel();
+    assert(!cancelled_ran.load() && !empty_cancelled);
+    assert(stopped > 10 && ticks.load() == stopped);
+    const bool never_cancelled = never.Cancel();
+    assert(never_cancelled);
+}
+
+// case: priority lanes, deadline order, NORMAL progress under a HIGH flood and LOW aging
+void TCase21() {
+    using Priority = Utils::AsyncTask::Priority;
+    std::vector<int> order;
+    std::mutex mutex;
+    std::atomic_int done = 0;
+    auto record = [&order, &mutex, &done](int id) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(id);
+        ++done;
+    };
+    auto wait_done = [&done](int count) {
+        // Not WaitForComplete, it would run the queued tasks on this thread too.
+        while (done.load() < count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
     };
 
-            DEF_LAMBDA(at, value, times, 1, 0);
-            DEF_LAMBDA(at, value, times, 2, 1);
-            DEF_LAMBDA(at, value, times, 3, 2);
-            DEF_LAMBDA(at, value, times, 4, 3);
-            DEF_LAMBDA(at, value, times, 5, 4);
-            DEF_LAMBDA(at, value, times, 6, 5);
-            DEF_LAMBDA(at, value, times, 7, 6);
-            DEF_LAMBDA(at, value, times, 8, 7);
-            DEF_LAMBDA(at, value, times, 9, 8);
+    {
+        Utils::AsyncTask::Policy policy;
+        policy.maxthread = 1;
+        policy.agelimit = std::chrono::seconds(10);
+        Utils::AsyncTask at(policy);
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+        std::atomic_bool started = false;
+        at.AddTask([opened, &started]() {
+            started = true;
+            opened.wait();
+        });
+        // The worker must be held by the gate, not pick the first HIGH tasks before it.
+        while (!started.load()) {
+            std::this_thread::yield();
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (auto i = 0; i < 10; ++i) {
+            at.AddTask(Priority::LOW, [&record]() { record(3); });
+            at.AddTask([&record]() { record(2); });
+            at.AddTask(Priority::HIGH, [&record]() { record(0); });
+        }
+        for (auto i = 3; i > 0; --i) {
+            at.AddTask(now + std::chrono::hours(i), [&record, i]() { record(i * 10); });
+        }
+        gate.set_value();
+        wait_done(33);
+        auto first = [&order](int id) { return std::find(order.begin(), order.end(), id) - order.begin(); };
+        auto last = [&order](int id) { return order.rend() - std::find(order.rbegin(), order.rend(), id) - 1; };
+        // A normal task gets its turn within the HIGH ones, the deadlines hours away wait for the normal queues to run
+        // empty, in order, and LOW runs last.
+        assert(first(2) < last(0));
+        assert(last(2) < first(10) && first(10) < first(20) && first(20) < first(30));
+        assert(last(30) < first(3) && std::count(order.begin(), order.end(), 3) == 10);
+    }
 
-            lambda9();
+    order.clear();
+    done = 0;
+    {
+        // Every HIGH or near deadline task adds two more, the normal tasks still run.
+        Utils::AsyncTask::Policy policy;
+        policy.maxthread = 1;
+        Utils::AsyncTask at(policy);
+        std::atomic_int normal = 0;
+        std::function<void()> flood = [&]() {
+            if (normal.load() < 10) {
+                at.AddTask(Priority::HIGH, [&flood]() { flood(); });
+                at.AddTask(std::chrono::steady_clock::now(), [&flood]() { flood(); });
+            }
         };
+        at.AddTask(Priority::HIGH, [&flood]() { flood(); });
+        for (auto i = 0; i < 10; ++i) {
+            at.AddTask([&normal]() { ++normal; });
+        }
+        // Generous bound, it only fails if the normal tasks starve.
+        for (auto i = 0; i < 10000 && normal.load() < 10; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(normal.load() == 10);
+        at.WaitForComplete();
+    }
 
-        Utils::AsyncTask at;
-        at.AddTask([&test_task, &at, &value]() { test_task(at, value, 2); });
+    order.clear();
+    done = 0;
+    {
+        Utils::AsyncTask::Policy policy;
+        policy.maxthread = 1;
+        policy.agelimit = std::chrono::milliseconds(20);
+        Utils::AsyncTask at(policy);
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+        at.AddTask([opened]() { opened.wait(); });
+        at.AddTask(Priority::LOW, [&record]() { record(3); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        for (auto i = 0; i < 10; ++i) {
+            at.AddTask(Priority::HIGH, [&record]() { record(0); });
+        }
+        gate.set_value();
+        wait_done(11);
+        assert(order.front() == 3);
     }
-    assert(value.load() == 0);
-    assert(g_value.load() == 0);
 }
 
-// case: Performance
-#pragma warning(disable : 4996 4244)
-void TCase8() {
-    auto lambda = [](int times, int loop) {
-        constexpr int PI_LEN = 1024;
-        char* result_pi = new char[times * PI_LEN]{};
-        {
-            auto calculate_pi = [](char* pi) {
-                int a = 1e4, c = 3e3, b = c, d = 0, e = 0, f[3000], g = 1, h = 0;
-                do {
-                    if (!--b) {
-                        sprintf(pi, "%04d", e + d / a), e = d % a, h = b = c -= 15;
-                        pi += 4;
-                    } else {
-                        f[b] = (d = d / g * b + a * (h ? f[b] : 2e3)) % (g = b * 2 - 1);
+// case: bounded queue, TryAddTask and timed AddTask against a full pool, tasks of the pool never wait for room
+void TCase22() {
+    using Status = Utils::AsyncTask::Status;
+    Utils::AsyncTask::Policy policy;
+    policy.maxthread = 2;
+    policy.capacity = 4;
+    Utils::AsyncTask at(policy);
+    std::promise<void> gate;
+    std::shared_future<void> opened = gate.get_future().share();
+    std::atomic_int count = 0;
+    for (auto i = 0; i < 4; ++i) {
+        const Status status = at.TryAddTask([opened, &count]() {
+            opened.wait();
+            ++count;
+        });
+        assert(status == Status::OK);
+    }
+    Utils::TaskFunction task = [value = std::make_unique<int>(1), &count]() { count += *value; };
+    Status status = at.TryAddTask(std::move(task));
+    assert(status == Status::FULL && task);
+    auto start = std::chrono::steady_clock::now();
+    status = at.AddTask(std::move(task), std::chrono::milliseconds(20));
+    assert(status == Status::FULL && task);
+    assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+    // Blocks until the gate opens.
+    std::thread producer([&at, &count]() {
+        for (auto i = 0; i < 100; ++i) {
+            at.AddTask([&count]() { ++count; });
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(count.load() == 0);
+    gate.set_value();
+    producer.join();
+    status = at.AddTask(std::move(task), std::chrono::seconds(10));
+    assert(status == Status::OK && !task);
+    at.WaitForComplete();
+    assert(count.load() == 105);
+
+    at.Shutdown();
+    task = []() {};
+    status = at.TryAddTask(std::move(task));
+    assert(status == Status::STOPPED && task);
+
+    // The only worker waits for a subtask, which WaitForComplete runs on this thread while the pool is full. The
+    // subtask adds more, which must not wait for room.
+    policy.maxthread = 1;
+    policy.capacity = 2;
+    Utils::AsyncTask full(policy);
+    std::atomic_int added = 0;
+    std::atomic_bool started = false;
+    full.AddTask([&full, &added, &started]() {
+        started = true;
+        std::promise<void> done;
+        std::future<void> subtask = done.get_future();
+        full.AddTask([&full, &added, &done]() {
+            full.AddTask([&added]() { ++added; });
+            full.AddTasks(2, [&added](size_t) { return [&added]() { ++added; }; });
+            done.set_value();
+        });
+        subtask.wait();
+    });
+    // On the worker, not helped by this thread.
+    while (!started.load()) {
+        std::this_thread::yield();
+    }
+    full.WaitForComplete();
+    assert(added.load() == 3);
+}
+
+// case: pinned workers and per NUMA node queues, every task runs on a thread pinned to one cpu
+void TCase23() {
+    Utils::AsyncTask::Policy policy;
+    policy.maxthread = 4;
+    policy.pinning = true;
+    policy.numa = true;
+    Utils::AsyncTask at(policy);
+    assert(at.NodeCount() >= 1);
+    constexpr int TASKS = 1000;
+    std::atomic_int count = 0;
+    std::atomic_bool pinned = true;
+    // The workers ignore a failed sched_setaffinity, pinning is only expected where a thread may pin itself.
+    bool pinnable = false;
+#if defined(__linux__)
+    std::thread([&pinnable]() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            return;
+        }
+        int cpu = 0;
+        while (!CPU_ISSET(cpu, &set)) {
+            ++cpu;
+        }
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pinnable = sched_setaffinity(0, sizeof(set), &set) == 0;
+    }).join();
+#endif
+    auto check = [&count, &pinned]() {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) != 1) {
+            pinned = false;
+        }
+#endif
+        ++count;
+    };
+    const size_t nodes = at.NodeCount() * 2;
+    for (size_t node = 0; node < nodes; ++node) {
+        for (auto i = 0; i < TASKS; ++i) {
+            at.AddTaskToNode(node, [&at, &check, node]() {
+                check();
+                at.AddTaskToNode(node + 1, check);
+            });
+        }
+    }
+    // Not WaitForComplete, it would run the tasks on this thread, which is not pinned.
+    while (count.load() < static_cast<int>(nodes) * TASKS * 2) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assert(pinned.load() || !pinnable);
+}
+
+// case: strands, tasks of one strand run one at a time and in submission order
+void TCase24() {
+    constexpr int PRODUCERS = 4;
+    constexpr int TASKS = 10000;
+    constexpr int STRANDS = 8;
+    Utils::AsyncTask at;
+    std::vector<std::unique_ptr<Utils::Strand>> strands;
+    // Plain ints, only ever touched by the tasks of their strand.
+    std::vector<std::vector<int>> last(STRANDS, std::vector<int>(PRODUCERS, -1));
+    std::vector<int> count(STRANDS, 0);
+    std::atomic_bool ordered = true;
+    std::atomic_bool exclusive = true;
+    std::unique_ptr<std::atomic_bool[]> busy(new std::atomic_bool[STRANDS]);
+    for (auto s = 0; s < STRANDS; ++s) {
+        strands.emplace_back(std::make_unique<Utils::Strand>(at, 16));
+        busy[s] = false;
+    }
+    std::vector<std::thread> producers;
+    for (auto p = 0; p < PRODUCERS; ++p) {
+        producers.emplace_back([&, p]() {
+            for (auto i = 0; i < TASKS; ++i) {
+                const int s = i % STRANDS;
+                Utils::Strand& strand = *strands[s];
+                strand.AddTask([&, s, p, i]() {
+                    // Only ever cleared, so the strands do not overwrite each other's result.
+                    if (busy[s].exchange(true) || !strand.RunningInThisThread() || strands[(s + 1) % STRANDS]->RunningInThisThread()) {
+                        exclusive = false;
                     }
-                } while (b);
-            };
-            Utils::AsyncTask at;
-            for (auto i = 0; i < times; ++i) {
-                at.AddTask([&calculate_pi, buf{result_pi + i * PI_LEN}, loop]() {
-                    for (auto i = 0; i < loop; i++) {
-                        calculate_pi(buf);
+                    if (last[s][p] >= i) {
+                        ordered = false;
+                    }
+                    last[s][p] = i;
+                    if (++count[s] % 1000 == 0) {
+                        // Added from the strand itself, runs after everything queued so far.
+                        strand.AddTask([&count, s]() { ++count[s]; });
                     }
+                    busy[s] = false;
                 });
             }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    for (auto& strand : strands) {
+        strand->Wait();
+    }
+    assert(ordered.load() && exclusive.load());
+    assert(std::accumulate(count.begin(), count.end(), 0) == PRODUCERS * TASKS + PRODUCERS * TASKS / 1000);
+
+    // On a shut-down pool the tasks are dropped, released with the strand instead of leaking.
+    auto captured = std::make_shared<int>(0);
+    {
+        Utils::Strand strand(at);
+        at.Shutdown();
+        for (auto i = 0; i < 3; ++i) {
+            strand.AddTask([captured]() { ++*captured; });
         }
-        for (auto i = 1; i < times; ++i) {
-            assert(memcmp(result_pi, result_pi + i * PI_LEN, PI_LEN) == 0);
+        assert(captured.use_count() == 4);
+    }
+    assert(captured.use_count() == 1 && *captured == 0);
+}
+
+// case: Performance, batched submission against one AddTask per task
+void TCase25() {
+    constexpr int TASKS = 10000;
+    Utils::AsyncTask at;
+    std::atomic_int count = 0;
+    auto tiny = [&count]() { ++count; };
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < TASKS; ++i) {
+        at.AddTask(tiny);
+    }
+    at.WaitForComplete();
+    auto single = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    at.AddTasks(TASKS, [&tiny](size_t) { return tiny; });
+    at.WaitForComplete();
+    auto batch = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    assert(count.load() == 2 * TASKS);
+    std::cout << "Add " << TASKS << " tiny tasks, AddTask one by one takes: " << single << "us, AddTasks takes: " << batch << "us" << std::endl;
+
+    std::vector<Utils::TaskFunction> tasks;
+    for (auto i = 0; i < 100; ++i) {
+        tasks.emplace_back([&at, &count, i]() {
+            // Nested batch, goes to this worker's own queue.
+            at.AddTasks(size_t(i), [&count](size_t) { return [&count]() { ++count; }; });
+            ++count;
+        });
+    }
+    {
+        Utils::TaskGroup group(at);
+        at.AddTasks(group, tasks.begin(), tasks.end());
+        group.Wait();
+    }
+    at.WaitForComplete();
+    assert(count.load() == 2 * TASKS + 100 + 99 * 100 / 2);
+
+    // A batch from outside is split over the queues of the running workers only, the idle slots and the shared ring
+    // stay untouched.
+    Utils::AsyncTask::Policy policy;
+    policy.minthread = 2;
+    policy.maxthread = 2;
+    Utils::AsyncTask pair(policy);
+    std::promise<void> gate;
+    std::shared_future<void> opened = gate.get_future().share();
+    std::atomic_int held = 0;
+    for (auto i = 0; i < 2; ++i) {
+        pair.AddTask([opened, &held]() {
+            ++held;
+            opened.wait();
+        });
+    }
+    while (held.load() < 2) {
+        std::this_thread::yield();
+    }
+    count = 0;
+    pair.AddTasks(TASKS, [&tiny](size_t) { return tiny; });
+    const auto slots = pair.Stats().queue_slots;
+    assert(std::count_if(slots.begin(), slots.end(), [](size_t n) { return n != 0; }) == 2);
+    assert(std::accumulate(slots.begin(), slots.end(), size_t(0)) >= size_t(TASKS));
+    gate.set_value();
+    pair.WaitForComplete();
+    assert(count.load() == TASKS);
+}
+
+// case: blocking regions, compensating threads keep the compute tasks running
+void TCase26() {
+    constexpr int BLOCKING = 8;
+    Utils::AsyncTask::Policy policy;
+    policy.maxthread = 2;
+    policy.maxblocking = BLOCKING;
+    Utils::AsyncTask at(policy);
+    std::atomic_int slept = 0;
+    std::atomic_int computed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < BLOCKING; ++i) {
+        at.AddTask([&slept]() {
+            Utils::AsyncTask::BlockingRegion region;
+            Utils::AsyncTask::BlockingRegion nested;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            ++slept;
+        });
+        at.AddTask([&computed]() { computed += Utils::AsyncTask::MarkBlocking([]() { return 1; }); });
+    }
+    // Not WaitForComplete, a helping caller would lend a thread of its own.
+    while (slept.load() < BLOCKING || computed.load() < BLOCKING) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // Without compensation the two threads would sleep 4 times in a row.
+    assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(300));
+    at.WaitForComplete();
+    for (auto i = 0; i < 100 && at.ThreadCount() > 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(at.ThreadCount() <= 2);
+}
+
+// case: instrumentation, the counters of a snapshot match the work done
+void TCase27() {
+    constexpr int TASKS = 10000;
+    Utils::AsyncTask at;
+    std::atomic_int count = 0;
+    for (auto i = 0; i < TASKS; ++i) {
+        at.AddTask([&count]() { ++count; });
+    }
+    at.WaitForComplete();
+    assert(count.load() == TASKS);
+    auto stats = at.Stats();
+    assert(stats.pending == 0);
+#if ASYNCTASK_STATS
+    assert(stats.total.executed == TASKS);
+    assert(std::accumulate(stats.wait_histogram.begin(), stats.wait_histogram.end(), uint64_t(0)) == TASKS);
+    assert(std::accumulate(stats.run_histogram.begin(), stats.run_histogram.end(), uint64_t(0)) == TASKS);
+    assert(stats.threads.size() == at.MaxConcurrency() + Utils::AsyncTask::Policy().maxblocking + 1);
+    using Statistics = Utils::AsyncTask::Statistics;
+    std::cout << "executed " << stats.total.executed << ", steals " << stats.total.steals << ", parks " << stats.total.parks << ", contended "
+              << stats.total.contended << ", wait p50 " << Statistics::Percentile(stats.wait_histogram, 0.5).count() << "ns p99 "
+              << Statistics::Percentile(stats.wait_histogram, 0.99).count() << "ns, run p99 " << Statistics::Percentile(stats.run_histogram, 0.99).count()
+              << "ns" << std::endl;
+#endif
+}
+
+// case: trace export, one begin, end and flow event per task with its label and parent
+void TCase28() {
+    constexpr int OUTER = 10;
+    constexpr int INNER = 20;
+    Utils::AsyncTask at;
+    at.AddTask([]() {});
+    at.WaitForComplete();
+    at.StartTrace();
+    {
+        Utils::AsyncTask::TraceLabel label("outer");
+        for (auto i = 0; i < OUTER; ++i) {
+            at.AddTask([&at]() {
+                Utils::AsyncTask::TraceLabel label("inner \"quoted\"");
+                at.AddTasks(INNER, [](size_t) { return []() {}; });
+            });
+        }
+    }
+    at.WaitForComplete();
+    at.StopTrace();
+    // Not traced.
+    at.AddTask([]() {});
+    at.WaitForComplete();
+    std::ostringstream out;
+    at.WriteTrace(out);
+    const std::string trace = out.str();
+    [[maybe_unused]] auto count = [&trace](const std::string& pattern) {
+        size_t n = 0;
+        for (auto at = trace.find(pattern); at != std::string::npos; at = trace.find(pattern, at + 1)) {
+            ++n;
         }
-        delete result_pi;
+        return n;
     };
-    constexpr int LOOP = 2048;
-    for (auto i = 0; i < 32; ++i) {
-        auto start = std::chrono::system_clock::now();
-        lambda(i, LOOP);
-        auto elapse = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count();
-        std::cout << "Run " << i << " * " << LOOP << " tiems of PI computing takes: " << elapse << std::endl;
+    assert(trace.find("{\"traceEvents\":[") == 0);
+#if ASYNCTASK_TRACE
+    constexpr size_t TASKS = OUTER + OUTER * INNER;
+    assert(count("\"ph\":\"B\"") == TASKS);
+    assert(count("\"ph\":\"E\"") == TASKS);
+    assert(count("\"ph\":\"s\"") == TASKS);
+    assert(count("\"name\":\"outer\",\"cat\":\"task\",\"ph\":\"B\"") == OUTER);
+    assert(count("\"name\":\"inner \\\"quoted\\\"\",\"cat\":\"task\",\"ph\":\"B\"") == OUTER * INNER);
+    // The inner tasks have an outer task for parent, the outer ones none.
+    assert(count("\"parent\":0}") == 2 * OUTER);
+#endif
+}
+
+// case: parking, bursts of short tasks with idle gaps wake the parked workers, spinning or not
+void TCase29() {
+    constexpr int BURSTS = 200;
+    std::mt19937 engine(29);
+    std::uniform_int_distribution<int> size(1, 16);
+    std::uniform_int_distribution<int> gap(0, 2);
+    for (size_t spincount : {size_t(0), size_t(1000)}) {
+        Utils::AsyncTask at(4, spincount);
+        std::atomic_int count = 0;
+        int expected = 0;
+        for (auto burst = 0; burst < BURSTS; ++burst) {
+            const int tasks = size(engine);
+            for (auto i = 0; i < tasks; ++i) {
+                // Every other task adds one more from a worker, which must wake a parked one too.
+                at.AddTask([&at, &count, i]() {
+                    if (i % 2 == 0) {
+                        at.AddTask([&count]() { ++count; });
+                    }
+                    ++count;
+                });
+            }
+            expected += tasks + (tasks + 1) / 2;
+            // Not WaitForComplete, it would run the tasks on this thread and hide a lost wakeup. Generous bound, it
+            // only fails if a task is left in the queues with every worker parked.
+            for (auto i = 0; i < 10000 && count.load() < expected; ++i) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            assert(count.load() == expected);
+            // Give the workers time to run out of spins and park.
+            std::this_thread::sleep_for(std::chrono::milliseconds(gap(engine)));
+        }
+        at.WaitForComplete();
+    }
+}
+
+// case: nested submissions stop allocating queue storage once the worker's queue reached its high-water mark
+void TCase30() {
+    constexpr int TASKS = 1000;
+    Utils::AsyncTask::Policy policy;
+    policy.minthread = 1;
+    policy.maxthread = 1;
+    Utils::AsyncTask at(policy);
+    // Idle slots allocate nothing.
+    const auto idle = at.Stats().queue_slots;
+    assert(std::all_of(idle.begin(), idle.end(), [](size_t slots) { return slots == 0; }));
+    std::vector<size_t> slots;
+    for (auto round = 0; round < 3; ++round) {
+        int sum = 0;
+        std::promise<void> done;
+        at.AddTask([&at, &sum, &done]() {
+            // The worker pops its own queue from the back, this one runs last.
+            at.AddTask([&done]() { done.set_value(); });
+            for (auto i = 0; i < TASKS; ++i) {
+                at.AddTask([&sum, i]() { sum += i; });
+            }
+        });
+        // Not WaitForComplete, this thread would help and take the tasks off the worker.
+        done.get_future().wait();
+        at.WaitForComplete();
+        assert(sum == TASKS * (TASKS - 1) / 2);
+        // The only thread runs in the first slot.
+        slots.push_back(at.Stats().queue_slots[0]);
     }
+    assert(slots[0] > TASKS && slots[1] == slots[0] && slots[2] == slots[0]);
 }
 
 }  // namespace AsynTask_T
 
 void AsynTask_Test() {
     UT_Case_ALL(AsynTask_T);
+}
+
+namespace AsynTask_B {
+
+// Sweep of a benchmark run, set from the command line.
+struct Options {
+    std::vector<size_t> threads;
+    std::vector<size_t> sizes = {0, 1000, 10000};
+    std::vector<size_t> producers = {1, 2, 4, 8};
+    size_t tasks = 100000;
+    size_t repeat = 5;
+    bool json = false;
+};
+
+// One line of the report. The samples are the mean of each run, or single tasks for latencies. The p99 is only given
+// for single tasks, out of a handful of runs it would be the worst one, which max reports.
+struct Result {
+    std::string benchmark;
+    size_t threads;
+    size_t producers;
+    size_t size;
+    size_t samples;
+    double median;
+    bool tasks;
+    double p99;
+    double max;
+    const char* unit;
+};
+
+// Busy task of about nanos nanoseconds, 0 returns right away.
+void Spin(size_t nanos) {
+    if (nanos == 0) {
+        return;
+    }
+    const auto end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(nanos);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+// Waits for the tasks without lending the calling thread to the pool, WaitForComplete would help run them.
+void Await(const std::atomic<size_t>& done, size_t count) {
+    while (done.load() < count) {
+        std::this_thread::yield();
+    }
+}
+
+double Nanos(std::chrono::steady_clock::duration duration) {
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+// tasks tells whether every sample is a single task rather than the mean of a run.
+Result Summarize(std::string benchmark, size_t threads, size_t producers, size_t size, std::vector<double> samples, bool tasks, const char* unit) {
+    std::sort(samples.begin(), samples.end());
+    // Nearest rank.
+    auto percentile = [&samples](double fraction) {
+        const size_t rank = static_cast<size_t>(std::ceil(fraction * static_cast<double>(samples.size())));
+        return samples[std::max<size_t>(rank, 1) - 1];
+    };
+    return Result{std::move(benchmark), threads, producers, size, samples.size(), percentile(0.5), tasks, percentile(0.99), samples.back(), unit};
+}
+
+Utils::AsyncTask::Policy Fixed(size_t threads) {
+    Utils::AsyncTask::Policy policy;
+    policy.minthread = threads;
+    policy.maxthread = threads;
+    return policy;
+}
+
+// Cost per task of AddTask from one thread, then of AddTasks, tasks of the given size.
+void Throughput(const Options& options, size_t threads, size_t size, std::vector<Result>& results) {
+    const size_t tasks = size == 0 ? options.tasks : std::max<size_t>(options.tasks * 1000 / (size + 1000), 1000);
+    std::vector<double> single;
+    std::vector<double> batch;
+    for (size_t run = 0; run < options.repeat; ++run) {
+        Utils::AsyncTask at(Fixed(threads));
+        std::atomic<size_t> done{0};
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < tasks; ++i) {
+            at.AddTask([&done, size]() {
+                Spin(size);
+                ++done;
+            });
+        }
+        Await(done, tasks);
+        single.push_back(Nanos(std::chrono::steady_clock::now() - start) / tasks);
+        done = 0;
+        start = std::chrono::steady_clock::now();
+        at.AddTasks(tasks, [&done, size](size_t) {
+            return [&done, size]() {
+                Spin(size);
+                ++done;
+            };
+        });
+        Await(done, tasks);
+        batch.push_back(Nanos(std::chrono::steady_clock::now() - start) / tasks);
+    }
+    results.push_back(Summarize("throughput", threads, 1, size, std::move(single), false, "ns/task"));
+    results.push_back(Summarize("batch", threads, 1, size, std::move(batch), false, "ns/task"));
+}
+
+// From AddTask until the task starts, one task at a time on an otherwise idle pool, so it measures the wakeup.
+void Latency(const Options& options, size_t threads, std::vector<Result>& results) {
+    const size_t tasks = std::min<size_t>(options.tasks / 10, 10000);
+    std::vector<double> samples;
+    for (size_t run = 0; run < options.repeat; ++run) {
+        Utils::AsyncTask at(Fixed(threads));
+        for (size_t i = 0; i < tasks; ++i) {
+            std::atomic<bool> started{false};
+            std::chrono::steady_clock::time_point begin;
+            const auto submit = std::chrono::steady_clock::now();
+            at.AddTask([&started, &begin]() {
+                begin = std::chrono::steady_clock::now();
+                started.store(true);
+            });
+            while (!started.load()) {
+                std::this_thread::yield();
+            }
+            samples.push_back(Nanos(begin - submit));
+        }
+    }
+    results.push_back(Summarize("latency", threads, 1, 0, std::move(samples), true, "ns"));
+}
+
+// Nested fan-out of TCase6: every task of the upper levels adds FANOUT tasks, the leaves do the work.
+void FanOut(const Options& options, size_t threads, size_t size, std::vector<Result>& results) {
+    constexpr size_t FANOUT = 10;
+    size_t depth = 1;
+    size_t tasks = FANOUT;
+    while (tasks * FANOUT <= options.tasks) {
+        tasks *= FANOUT;
+        ++depth;
+    }
+    std::vector<double> samples;
+    for (size_t run = 0; run < options.repeat; ++run) {
+        Utils::AsyncTask at(Fixed(threads));
+        std::atomic<size_t> done{0};
+        std::function<void(size_t)> level = [&](size_t remaining) {
+            if (remaining == 0) {
+                Spin(size);
+                ++done;
+                return;
+            }
+            for (size_t i = 0; i < FANOUT; ++i) {
+                at.AddTask([&level, remaining]() { level(remaining - 1); });
+            }
+        };
+        const auto start = std::chrono::steady_clock::now();
+        at.AddTask([&level, depth]() { level(depth); });
+        Await(done, tasks);
+        samples.push_back(Nanos(std::chrono::steady_clock::now() - start) / tasks);
+        at.WaitForComplete();
+    }
+    results.push_back(Summarize("fanout", threads, 1, size, std::move(samples), false, "ns/task"));
+}
+
+// Empty tasks added by several threads at once.
+void Producers(const Options& options, size_t threads, size_t producers, std::vector<Result>& results) {
+    const size_t each = options.tasks / producers;
+    std::vector<double> samples;
+    for (size_t run = 0; run < options.repeat; ++run) {
+        Utils::AsyncTask at(Fixed(threads));
+        std::atomic<size_t> done{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> submitters;
+        for (size_t p = 0; p < producers; ++p) {
+            submitters.emplace_back([&at, &done, &go, each]() {
+                while (!go.load()) {
+                    std::this_thread::yield();
+                }
+                for (size_t i = 0; i < each; ++i) {
+                    at.AddTask([&done]() { ++done; });
+                }
+            });
+        }
+        const auto start = std::chrono::steady_clock::now();
+        go = true;
+        Await(done, each * producers);
+        samples.push_back(Nanos(std::chrono::steady_clock::now() - start) / (each * producers));
+        for (auto& submitter : submitters) {
+            submitter.join();
+        }
+    }
+    results.push_back(Summarize("producers", threads, producers, 0, std::move(samples), false, "ns/task"));
+}
+
+void Report(const std::vector<Result>& results, bool json, std::ostream& out) {
+    // Empty in the CSV and null in the JSON when the p99 is not given.
+    if (json) {
+        out << "[";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            out << (i == 0 ? "\n" : ",\n") << "{\"benchmark\":\"" << r.benchmark << "\",\"threads\":" << r.threads << ",\"producers\":" << r.producers
+                << ",\"task_ns\":" << r.size << ",\"samples\":" << r.samples << ",\"median\":" << r.median << ",\"p99\":";
+            if (r.tasks) {
+                out << r.p99;
+            } else {
+                out << "null";
+            }
+            out << ",\"max\":" << r.max << ",\"unit\":\"" << r.unit << "\"}";
+        }
+        out << "\n]" << std::endl;
+    } else {
+        out << "benchmark,threads,producers,task_ns,samples,median,p99,max,unit\n";
+        for (const Result& r : results) {
+            out << r.benchmark << "," << r.threads << "," << r.producers << "," << r.size << "," << r.samples << "," << r.median << ",";
+            if (r.tasks) {
+                out << r.p99;
+            }
+            out << "," << r.max << "," << r.unit << "\n";
+        }
+        out << std::flush;
+    }
+}
+
+// Comma separated numbers, empty on a malformed list or on a number too large for size_t.
+std::vector<size_t> ParseList(const char* list) {
+    std::vector<size_t> values;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (item.empty() || item.find_first_not_of("0123456789") != std::string::npos) {
+            return {};
+        }
+        size_t value = 0;
+        for (char digit : item) {
+            if (value > (SIZE_MAX - (digit - '0')) / 10) {
+                return {};
+            }
+            value = value * 10 + (digit - '0');
+        }
+        values.push_back(value);
+    }
+    return values;
+}
+
+}  // namespace AsynTask_B
+
+// Options: [--json] [--repeat N] [--tasks N] [--threads 1,2,4] [--sizes 0,1000] [--producers 1,2,4]. Pools of 1 thread
+// and doubling up to the CPU count by default. Writes CSV, or JSON, to stdout. Returns 1 on a bad option, 0 otherwise.
+int AsynTask_Benchmark(int argc, char* argv[]) {
+    using namespace AsynTask_B;
+    Options options;
+    const size_t cpus = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t threads = 1; threads < cpus; threads *= 2) {
+        options.threads.push_back(threads);
+    }
+    options.threads.push_back(cpus);
+    for (int i = 0; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--json") {
+            options.json = true;
+            continue;
+        }
+        const std::vector<size_t> list = ParseList(i + 1 < argc ? argv[i + 1] : "");
+        const bool positive = !list.empty() && std::find(list.begin(), list.end(), 0) == list.end();
+        if (arg == "--repeat" && positive && list.size() == 1) {
+            options.repeat = list[0];
+        } else if (arg == "--tasks" && list.size() == 1 && list[0] >= 1000) {
+            options.tasks = list[0];
+        } else if (arg == "--threads" && positive) {
+            options.threads = list;
+        } else if (arg == "--sizes" && !list.empty()) {
+            options.sizes = list;
+        } else if (arg == "--producers" && positive) {
+            options.producers = list;
+        } else {
+            std::cerr << "Unknown or malformed option " << arg << std::endl;
+            return 1;
+        }
+        ++i;
+    }
+    // Every producer adds tasks / producers tasks, none would leave nothing to time.
+    if (*std::max_element(options.producers.begin(), options.producers.end()) > options.tasks) {
+        std::cerr << "--producers must not exceed --tasks" << std::endl;
+        return 1;
+    }
+    std::vector<Result> results;
+    for (size_t threads : options.threads) {
+        for (size_t size : options.sizes) {
+            Throughput(options, threads, size, results);
+            FanOut(options, threads, size, results);
+        }
+        Latency(options, threads, results);
+        for (size_t producers : options.producers) {
+            Producers(options, threads, producers, results);
+        }
+    }
+    Report(results, options.json, std::cout);
+    return 0;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <memory.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +17,8 @@ typedef struct {
 } VTable;
 
 typedef struct _Shape {
-    VTable* vtable;
+    // Shared by every shape of a type, never freed.
+    const VTable* vtable;
     char name[20];
 } Shape;
 
@@ -23,16 +26,18 @@ void shapePrint(Shape* c) {
     printf("%s\n", c->name);
 }
 
+static const VTable shapeVTable = {shapePrint, NULL};
+
 void initShape(Shape* s, const char* name) {
-    s->vtable = (VTable*)malloc(sizeof(VTable));
+    s->vtable = &shapeVTable;
     strncpy_s(s->name, sizeof(s->name) - 1, name, sizeof(s->name) - 1);
     s->name[sizeof(s->name) - 1] = 0;
-    s->vtable->ToString = shapePrint;
-    s->vtable->CalculateArea = NULL;
 }
 
+// Nothing to free, the vtables are static. Kept so that every init has its release.
 void releaseShape(Shape* s, const char* name) {
-    free(s->vtable);
+    (void)s;
+    (void)name;
 }
 
 typedef struct _Square {
@@ -45,15 +50,17 @@ double squareCalculate(Square* s) {
     return s->height * s->width;
 }
 
+static const VTable squareVTable = {shapePrint, (double (*)(Shape*))squareCalculate};
+
 void initSquare(Square* s, const char* name, int w, int h) {
     initShape((Shape*)s, name);
     s->height = h;
     s->width = w;
-    ((Shape*)s)->vtable->CalculateArea = (double (*)(Shape*))squareCalculate;
+    ((Shape*)s)->vtable = &squareVTable;
 }
 
 void releaseSquare(Square* s) {
-    free(((Shape*)s)->vtable);
+    (void)s;
 }
 
 typedef struct _Circle {
@@ -65,14 +72,104 @@ double circleCalculate(Circle* c) {
     return M_PI_2 * c->radius * c->radius;
 }
 
+static const VTable circleVTable = {shapePrint, (double (*)(Shape*))circleCalculate};
+
 void initCircle(Circle* c, const char* name, int r) {
     initShape((Shape*)c, name);
     c->radius = r;
-    ((Shape*)c)->vtable->CalculateArea = (double (*)(Shape*))circleCalculate;
+    ((Shape*)c)->vtable = &circleVTable;
 }
 
 void releaseCircle(Circle* s) {
-    free(((Shape*)s)->vtable);
+    (void)s;
+}
+
+// Memory of a shape population. Shapes are carved out of large blocks and all released at once by releaseArena, a
+// population costs a handful of mallocs instead of one per shape.
+typedef struct _ArenaBlock {
+    struct _ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;
+    // Bytes of a new block, a bulk create larger than that gets a block of its own.
+    size_t blockSize;
+} ShapeArena;
+
+// Offset of the memory of a block, after its header.
+#define ARENA_HEADER ((sizeof(ArenaBlock) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t))
+
+void initArena(ShapeArena* arena, size_t blockSize) {
+    arena->blocks = NULL;
+    arena->blockSize = blockSize;
+}
+
+// Memory for bytes, aligned for any shape, NULL when out of memory or when bytes is too large for a block.
+void* arenaAllocate(ShapeArena* arena, size_t bytes) {
+    if (bytes > SIZE_MAX - (alignof(max_align_t) - 1)) {
+        return NULL;
+    }
+    bytes = (bytes + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+    ArenaBlock* head = arena->blocks;
+    if (head != NULL && head->size - head->used >= bytes) {
+        void* memory = (char*)head + ARENA_HEADER + head->used;
+        head->used += bytes;
+        return memory;
+    }
+    size_t size = bytes > arena->blockSize ? bytes : arena->blockSize;
+    if (size > SIZE_MAX - ARENA_HEADER) {
+        return NULL;
+    }
+    ArenaBlock* block = (ArenaBlock*)malloc(ARENA_HEADER + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->size = size;
+    block->used = bytes;
+    // The head keeps bump allocating unless the new block has more room left, an oversized request gets a block of
+    // its own behind it and wastes nothing.
+    if (head == NULL || size - bytes > head->size - head->used) {
+        block->next = head;
+        arena->blocks = block;
+    } else {
+        block->next = head->next;
+        head->next = block;
+    }
+    return (char*)block + ARENA_HEADER;
+}
+
+// Frees every shape created in the arena.
+void releaseArena(ShapeArena* arena) {
+    while (arena->blocks != NULL) {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+// count squares side by side in the arena, NULL when out of memory or when count is too large.
+Square* createSquares(ShapeArena* arena, size_t count, const char* name, int w, int h) {
+    if (count > SIZE_MAX / sizeof(Square)) {
+        return NULL;
+    }
+    Square* squares = (Square*)arenaAllocate(arena, count * sizeof(Square));
+    for (size_t i = 0; squares != NULL && i < count; ++i) {
+        initSquare(&squares[i], name, w, h);
+    }
+    return squares;
+}
+
+Circle* createCircles(ShapeArena* arena, size_t count, const char* name, int r) {
+    if (count > SIZE_MAX / sizeof(Circle)) {
+        return NULL;
+    }
+    Circle* circles = (Circle*)arenaAllocate(arena, count * sizeof(Circle));
+    for (size_t i = 0; circles != NULL && i < count; ++i) {
+        initCircle(&circles[i], name, r);
+    }
+    return circles;
 }
 
 namespace CPolymorphism_T {
@@ -93,6 +190,52 @@ void TCase0() {
     releaseCircle(&circle);
 }
 
+void TCase1() {
+    const size_t COUNT = 10000;
+    ShapeArena arena;
+    initArena(&arena, 64 * 1024);
+    Square* squares = createSquares(&arena, COUNT, "square", 4, 5);
+    Circle* circles = createCircles(&arena, COUNT, "circle", 1);
+    Square* single = createSquares(&arena, 1, "single", 2, 3);
+    assert(squares != NULL && circles != NULL && single != NULL);
+    double area = 0;
+    for (size_t i = 0; i < COUNT; ++i) {
+        Shape* square = (Shape*)&squares[i];
+        Shape* circle = (Shape*)&circles[i];
+        assert(square->vtable == ((Shape*)squares)->vtable && circle->vtable == ((Shape*)circles)->vtable);
+        area += square->vtable->CalculateArea(square) + circle->vtable->CalculateArea(circle);
+    }
+    assert(fabs(area - COUNT * (20 + M_PI_2)) < 1e-6);
+    assert(((Shape*)single)->vtable->CalculateArea((Shape*)single) == 6);
+    size_t blocks = 0;
+    for (ArenaBlock* block = arena.blocks; block != NULL; block = block->next) {
+        ++blocks;
+    }
+    assert(blocks <= 1 + (COUNT * (sizeof(Square) + sizeof(Circle))) / arena.blockSize + 2);
+    releaseArena(&arena);
+    assert(arena.blocks == NULL);
+}
+
+void TCase2() {
+    ShapeArena arena;
+    initArena(&arena, 1024);
+    Square* first = createSquares(&arena, 1, "first", 1, 1);
+    ArenaBlock* head = arena.blocks;
+    // Larger than a block, gets its own behind the head.
+    Square* large = createSquares(&arena, 1000, "large", 2, 2);
+    Square* second = createSquares(&arena, 1, "second", 3, 3);
+    assert(first != NULL && large != NULL && second != NULL);
+    assert(arena.blocks == head && head->next != NULL && head->next->next == NULL);
+    assert((char*)second - (char*)first == (ptrdiff_t)((sizeof(Square) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t)));
+    assert(((Shape*)&large[999])->vtable->CalculateArea((Shape*)&large[999]) == 4);
+    // Sizes that do not fit in size_t are refused instead of wrapping around.
+    assert(createSquares(&arena, SIZE_MAX / sizeof(Square) + 1, "huge", 1, 1) == NULL);
+    assert(createCircles(&arena, SIZE_MAX / sizeof(Circle) + 1, "huge", 1) == NULL);
+    assert(arenaAllocate(&arena, SIZE_MAX) == NULL);
+    assert(arenaAllocate(&arena, SIZE_MAX - ARENA_HEADER) == NULL);
+    releaseArena(&arena);
+}
+
 }  // namespace CPolymorphism_T
 
 void CPolymorphism_Test() {
@@ -42,10 +42,17 @@
     UT_Case(26, domain);    \
     UT_Case(27, domain);    \
     UT_Case(28, domain);    \
-    UT_Case(29, domain);
+    UT_Case(29, domain);    \
+    UT_Case(30, domain);
 
 #define Test(name)             \
     extern void name##_Test(); \
     name##_Test()
 
+#define Benchmark(name, argc, argv)                     \
+    [&]() {                                             \
+        extern int name##_Benchmark(int, char* []);     \
+        return name##_Benchmark(argc, argv);            \
+    }()
+
 #endif  // !_COMMON_H_
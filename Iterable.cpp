@@ -1,76 +1,273 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
 #include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include "Common.h"
+#if defined(__GNUC__) || defined(__clang__)
+#define ITERABLE_PREFETCH(address) __builtin_prefetch(address)
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define ITERABLE_PREFETCH(address) _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#else
+#define ITERABLE_PREFETCH(address) ((void)(address))
+#endif
 
 namespace Utils {
 
+// &Type::at and &Type::operator[] with the signature Member, null if Type has none.
+template <typename Type, typename Member, typename = void>
+struct AtMember {
+    static constexpr Member value = nullptr;
+};
+
+template <typename Type, typename Member>
+struct AtMember<Type, Member, std::void_t<decltype(static_cast<Member>(&Type::at))>> {
+    static constexpr Member value = static_cast<Member>(&Type::at);
+};
+
+template <typename Type, typename Member, typename = void>
+struct SubscriptMember {
+    static constexpr Member value = nullptr;
+};
+
+template <typename Type, typename Member>
+struct SubscriptMember<Type, Member, std::void_t<decltype(static_cast<Member>(&Type::operator[]))>> {
+    static constexpr Member value = static_cast<Member>(&Type::operator[]);
+};
+
+// Whether the elements Get returns are the array at data(), so that iterating is walking a pointer. Detected for at
+// and operator[] of the containers with a data() member, std::vector, std::array, std::string. Specialize it as
+// std::true_type for other containers with such a data().
+template <typename Type, typename ElementType, typename SizeType, ElementType& (Type::*Get)(SizeType), typename = void>
+struct IsContiguous : std::false_type {};
+
+template <typename Type, typename ElementType, typename SizeType, ElementType& (Type::*Get)(SizeType)>
+struct IsContiguous<Type, ElementType, SizeType, Get,
+                    std::enable_if_t<std::is_same<decltype(std::declval<Type&>().data()), std::remove_reference_t<ElementType>*>::value>> {
+    using Getter = ElementType& (Type::*)(SizeType);
+    // Compared as template arguments, pointers to different members do not compare in a constant expression with GCC.
+    template <Getter Other>
+    using Is = std::is_same<std::integral_constant<Getter, Get>, std::integral_constant<Getter, Other>>;
+    static constexpr bool value = Is<AtMember<Type, Getter>::value>::value || Is<SubscriptMember<Type, Getter>::value>::value;
+};
+
+// A pair of random access iterators usable in range loops and the parallel algorithms below.
+template <typename Iterator>
+class Range {
+public:
+    Range(Iterator first, Iterator last) : m_First(first), m_Last(last) {
+    }
+
+    Iterator begin() const {
+        return m_First;
+    }
+
+    Iterator end() const {
+        return m_Last;
+    }
+
+    size_t size() const {
+        return static_cast<size_t>(m_Last - m_First);
+    }
+
+private:
+    Iterator m_First;
+    Iterator m_Last;
+};
+
 template <typename Type, typename ElementType, typename SizeType, SizeType (Type::*Count)() const, ElementType& (Type::*Get)(SizeType)>
 class Iterable {
+public:
+    static constexpr bool Contiguous = IsContiguous<Type, ElementType, SizeType, Get>::value;
+
+    // Random access iterator over the indexes [0, Count()) of the container.
     class Iterator {
     public:
-        Iterator(Type& container, SizeType index) : m_Container(container), m_Index(index) {
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = std::remove_cv_t<std::remove_reference_t<ElementType>>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::remove_reference_t<ElementType>*;
+        using reference = std::remove_reference_t<ElementType>&;
+
+        Iterator() = default;
+
+        Iterator(Type& container, SizeType index) : m_Container(&container), m_Index(index) {
         }
 
-        Iterator(const Iterator& it) : m_Container(it.m_Container), m_Index(it.m_Index) {
+        reference operator*() const {
+            assert(m_Index >= 0 && m_Index < (m_Container->*Count)());
+            return (m_Container->*Get)(m_Index);
         }
 
-        Iterator& operator=(const Iterator& it) {
-            this->m_Container = it.m_Container;
-            m_Index = it.m_Index;
+        pointer operator->() const {
+            return &**this;
         }
 
-        bool operator==(const Iterator& it) {
-            return m_Index == it.m_Index && &m_Container == &it.m_Container;
+        reference operator[](difference_type n) const {
+            return *(*this + n);
         }
 
-        bool operator!=(const Iterator& it) {
-            return !(*this == it);
+        Iterator& operator++() {
+            ++m_Index;
+            return *this;
         }
 
-        void operator++() {
+        Iterator operator++(int) {
+            Iterator it = *this;
             ++m_Index;
+            return it;
         }
 
-        void operator++(int) {
-            m_Index++;
+        Iterator& operator--() {
+            --m_Index;
+            return *this;
         }
 
-        void operator--() {
+        Iterator operator--(int) {
+            Iterator it = *this;
             --m_Index;
+            return it;
         }
 
-        void operator--(int) {
-            m_Index--;
+        Iterator& operator+=(difference_type n) {
+            m_Index = static_cast<SizeType>(static_cast<difference_type>(m_Index) + n);
+            return *this;
         }
 
-        ElementType& operator*() {
-            assert(m_Index >= 0 && m_Index < (m_Container.*Count)());
-            return (m_Container.*Get)(m_Index);
+        Iterator& operator-=(difference_type n) {
+            return *this += -n;
+        }
+
+        friend Iterator operator+(Iterator it, difference_type n) {
+            return it += n;
+        }
+
+        friend Iterator operator+(difference_type n, Iterator it) {
+            return it += n;
+        }
+
+        friend Iterator operator-(Iterator it, difference_type n) {
+            return it -= n;
+        }
+
+        friend difference_type operator-(const Iterator& left, const Iterator& right) {
+            assert(left.m_Container == right.m_Container);
+            return static_cast<difference_type>(left.m_Index) - static_cast<difference_type>(right.m_Index);
+        }
+
+        friend bool operator==(const Iterator& left, const Iterator& right) {
+            return left.m_Index == right.m_Index && left.m_Container == right.m_Container;
+        }
+
+        friend bool operator!=(const Iterator& left, const Iterator& right) {
+            return !(left == right);
+        }
+
+        friend bool operator<(const Iterator& left, const Iterator& right) {
+            return left - right < 0;
+        }
+
+        friend bool operator>(const Iterator& left, const Iterator& right) {
+            return right < left;
+        }
+
+        friend bool operator<=(const Iterator& left, const Iterator& right) {
+            return !(right < left);
+        }
+
+        friend bool operator>=(const Iterator& left, const Iterator& right) {
+            return !(left < right);
         }
 
     private:
-        SizeType m_Index;
-        Type& m_Container;
+        Type* m_Container = nullptr;
+        SizeType m_Index = 0;
     };
 
-public:
     Iterable(Type& container) : m_Container(container) {
     }
 
     Iterable(const Iterable& iterable) : m_Container(iterable.m_Container) {
     }
 
-    Iterable& operator=(const Iterable& iterable) {
-        this.m_Container = iterable.m_Container;
+    // Raw pointers when the container is Contiguous, Iterator otherwise.
+    auto begin() {
+        if constexpr (Contiguous) {
+            return m_Container.data();
+        } else {
+            return Iterator(m_Container, 0);
+        }
     }
 
-    Iterator begin() {
-        return Iterator(m_Container, 0);
+    auto end() {
+        if constexpr (Contiguous) {
+            return m_Container.data() + (m_Container.*Count)();
+        } else {
+            return Iterator(m_Container, (m_Container.*Count)());
+        }
     }
 
-    Iterator end() {
-        return Iterator(m_Container, (m_Container.*Count)());
+    size_t size() const {
+        return static_cast<size_t>((m_Container.*Count)());
+    }
+
+    /// \brief Calls function(const value_type* block, size_t count) for the elements in blocks of up to N, so the inner
+    /// loop runs over an array the compiler can vectorize. Blocks of a Contiguous container, or whose elements Get
+    /// happens to return side by side, point into the container. The others are copied into a buffer, and the elements
+    /// distance ahead are prefetched meanwhile, hiding the misses of a Get that follows pointers.
+    template <size_t N = 64, typename Function>
+    void ForEachBlock(const Function& function, size_t distance = N) {
+        using Value = std::remove_cv_t<std::remove_reference_t<ElementType>>;
+        const size_t count = size();
+        if constexpr (Contiguous) {
+            const Value* data = m_Container.data();
+            for (size_t first = 0; first < count; first += N) {
+                function(data + first, std::min(N, count - first));
+            }
+        } else {
+            std::array<const Value*, N> addresses;
+            std::array<Value, N> buffer;
+            for (size_t first = 0; first < count; first += N) {
+                const size_t n = std::min(N, count - first);
+                for (size_t ahead = first + distance, last = std::min(ahead + n, count); distance != 0 && ahead < last; ++ahead) {
+                    ITERABLE_PREFETCH(&(m_Container.*Get)(static_cast<SizeType>(ahead)));
+                }
+                bool contiguous = true;
+                for (size_t i = 0; i < n; ++i) {
+                    addresses[i] = &(m_Container.*Get)(static_cast<SizeType>(first + i));
+                    contiguous = contiguous && addresses[i] == addresses[0] + i;
+                }
+                if (contiguous) {
+                    function(addresses[0], n);
+                    continue;
+                }
+                for (size_t i = 0; i < n; ++i) {
+                    buffer[i] = *addresses[i];
+                }
+                function(static_cast<const Value*>(buffer.data()), n);
+            }
+        }
+    }
+
+    // The elements [first, last), a chunk to hand to another thread.
+    auto Slice(size_t first, size_t last) {
+        assert(first <= last && last <= size());
+        return Range<decltype(begin())>(begin() + first, begin() + last);
     }
 
     static auto MakeIterable(Type& container) {
@@ -86,10 +283,673 @@ auto MakeIterable(Type& container) {
     return Iterable<Type, ElementType, SizeType, Count, Get>(container);
 }
 
+/*  Examples:
+    {
+        Utils::AsyncTask pool;
+        auto iterable = Utils::MakeIterable<...>(container);
+        Utils::ParallelForEach(pool, iterable, [](auto& element) { ... });
+        auto sum = Utils::ParallelTransformReduce(pool, iterable, 0.0, std::plus<>(), [](auto& element) { return element.value; });
+    }
+*/
+// One parallel loop over the blocks [0, m_Blocks), shared by the caller and the tasks it added to the pool. A task may
+// start after the loop is over and the caller is gone, it finds no block left and touches nothing but this.
+class BlockLoop {
+public:
+    // A thread claims blocks for about this long at a time, short enough to balance, long enough to not contend.
+    static constexpr std::chrono::microseconds TARGET = std::chrono::microseconds(50);
+    // Blocks a range is cut into by default, the partials of a reduction are combined in this order.
+    static constexpr size_t DEFAULT_BLOCKS = 4096;
+
+    BlockLoop(size_t blocks, size_t concurrency) : m_Blocks(blocks), m_MaxStep(std::max<size_t>(blocks / (4 * std::max<size_t>(concurrency, 1)), 1)) {
+    }
+
+    // Runs body(block) for the blocks left, claiming more of them at once while they are cheap.
+    template <typename Body>
+    void Run(const Body& body) {
+        size_t step = 1;
+        while (true) {
+            const size_t first = m_Next.fetch_add(step);
+            if (first >= m_Blocks) {
+                return;
+            }
+            const size_t last = std::min(first + step, m_Blocks);
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t block = first; block < last && !m_Failed.load(std::memory_order_relaxed); ++block) {
+                try {
+                    body(block);
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(m_Mutex);
+                    if (!m_Failed.exchange(true)) {
+                        m_Error = std::current_exception();
+                    }
+                }
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            if (elapsed < TARGET / 2 && step < m_MaxStep) {
+                step = std::min(step * 2, m_MaxStep);
+            } else if (elapsed > TARGET * 2 && step > 1) {
+                step /= 2;
+            }
+            if (m_Done.fetch_add(last - first) + (last - first) == m_Blocks) {
+                std::lock_guard<std::mutex> guard(m_Mutex);
+                m_Condition.notify_all();
+            }
+        }
+    }
+
+    // Waits for the blocks claimed by the other threads, then rethrows the first exception of body, if any.
+    void Wait() {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Condition.wait(lock, [this] { return m_Done.load() == m_Blocks; });
+        if (m_Error) {
+            std::rethrow_exception(m_Error);
+        }
+    }
+
+private:
+    const size_t m_Blocks;
+    const size_t m_MaxStep;
+    std::atomic<size_t> m_Next{0};
+    std::atomic<size_t> m_Done{0};
+    std::atomic<bool> m_Failed{false};
+    std::exception_ptr m_Error;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+};
+
+/// \brief Runs body(block) for every block of [0, blocks) on pool and the calling thread, returns once all are done.
+/// pool only needs AddTask(callable) and MaxConcurrency(), Utils::AsyncTask for one. The caller works too, so a task of
+/// pool may call it. concurrency is the number of threads to spread the blocks over, pool.MaxConcurrency() if 0.
+template <typename Pool, typename Body>
+void ParallelBlocks(Pool& pool, size_t blocks, const Body& body, size_t concurrency) {
+    if (blocks == 0) {
+        return;
+    }
+    if (concurrency == 0) {
+        concurrency = pool.MaxConcurrency();
+    }
+    auto loop = std::make_shared<BlockLoop>(blocks, concurrency);
+    const size_t helpers = std::min(std::max<size_t>(concurrency, 1), blocks) - 1;
+    for (size_t i = 0; i < helpers; ++i) {
+        pool.AddTask([loop, &body]() { loop->Run(body); });
+    }
+    loop->Run(body);
+    loop->Wait();
+}
+
+// Elements per block, grain if given. The default only depends on the size, so reductions are deterministic whatever
+// the pool.
+inline size_t BlockSize(size_t size, size_t grain) {
+    return grain != 0 ? grain : std::max<size_t>((size + BlockLoop::DEFAULT_BLOCKS - 1) / BlockLoop::DEFAULT_BLOCKS, 1);
+}
+
+/// \brief Calls function on every element of range, a random access range such as an Iterable, in parallel on pool.
+/// Elements are handed out in blocks of grain, a default fitting the size if 0, and every thread claims more blocks
+/// at a time while they run fast, so cheap and costly elements both keep the threads busy without contention. The
+/// blocks are spread over concurrency threads, as many as pool runs at once if 0.
+template <typename Pool, typename Range, typename Function>
+void ParallelForEach(Pool& pool, Range&& range, const Function& function, size_t grain = 0,
+                     size_t concurrency = 0) {
+    const auto first = range.begin();
+    const size_t size = static_cast<size_t>(range.end() - first);
+    const size_t block = BlockSize(size, grain);
+    ParallelBlocks(
+        pool, (size + block - 1) / block,
+        [first, size, block, &function](size_t index) {
+            auto it = first + index * block;
+            const auto last = first + std::min(size, (index + 1) * block);
+            for (; it != last; ++it) {
+                function(*it);
+            }
+        },
+        concurrency);
+}
+
+/// \brief reduce(init, transform(element)...) over range in parallel on pool, as std::transform_reduce. Every block is
+/// folded in order, then the blocks are, so the result only depends on the range and grain, not on the timing or
+/// the number of threads, even when reduce is not associative like a sum of doubles.
+template <typename Pool, typename Range, typename T, typename Reduce, typename Transform>
+T ParallelTransformReduce(Pool& pool, Range&& range, T init, const Reduce& reduce, const Transform& transform, size_t grain = 0,
+                          size_t concurrency = 0) {
+    const auto first = range.begin();
+    const size_t size = static_cast<size_t>(range.end() - first);
+    const size_t block = BlockSize(size, grain);
+    const size_t blocks = (size + block - 1) / block;
+    std::vector<T> partials(blocks, init);
+    ParallelBlocks(
+        pool, blocks,
+        [first, size, block, &partials, &reduce, &transform](size_t index) {
+            auto it = first + index * block;
+            const auto last = first + std::min(size, (index + 1) * block);
+            T partial = transform(*it);
+            for (++it; it != last; ++it) {
+                partial = reduce(std::move(partial), transform(*it));
+            }
+            partials[index] = std::move(partial);
+        },
+        concurrency);
+    for (auto& partial : partials) {
+        init = reduce(std::move(init), std::move(partial));
+    }
+    return init;
+}
+
+/*  Examples:
+    {
+        auto iterable = Utils::MakeIterable<...>(container);
+        // One pass, no temporary container, the stages inline into the loop.
+        for (auto [a, b] : iterable | Utils::Map(f) | Utils::Filter(p) | Utils::Zip(other) | Utils::Take(10)) {
+            ...
+        }
+    }
+*/
+// Base of the adaptors that operator| applies to a range.
+struct ViewAdaptor {};
+
+// The range a view reads from: an lvalue is referred to by its iterators, an rvalue, another view usually, is kept.
+template <typename R>
+auto All(R&& range) {
+    if constexpr (std::is_lvalue_reference<R>::value) {
+        return Range<decltype(range.begin())>(range.begin(), range.end());
+    } else {
+        return std::decay_t<R>(std::move(range));
+    }
+}
+
+template <typename R>
+using AllOf = decltype(All(std::declval<R>()));
+
+template <typename R, typename Adaptor, typename = std::enable_if_t<std::is_base_of<ViewAdaptor, Adaptor>::value>>
+auto operator|(R&& range, const Adaptor& adaptor) {
+    return adaptor(All(std::forward<R>(range)));
+}
+
+// The weaker of two iterator categories, random access at most.
+template <typename First, typename Second>
+using CommonCategory = std::conditional_t<
+    std::is_base_of<std::random_access_iterator_tag, First>::value && std::is_base_of<std::random_access_iterator_tag, Second>::value,
+    std::random_access_iterator_tag,
+    std::conditional_t<std::is_base_of<std::bidirectional_iterator_tag, First>::value && std::is_base_of<std::bidirectional_iterator_tag, Second>::value,
+                       std::bidirectional_iterator_tag, std::forward_iterator_tag>>;
+
+// The operators of a random access iterator Derived, from its ++, --, += and Distance. Only the ones used are
+// instantiated, so a view over a forward range has a forward iterator.
+template <typename Derived, typename Difference>
+class IteratorOperators {
+public:
+    friend Derived operator++(Derived& it, int) {
+        Derived copy = it;
+        ++it;
+        return copy;
+    }
+
+    friend Derived operator--(Derived& it, int) {
+        Derived copy = it;
+        --it;
+        return copy;
+    }
+
+    friend Derived& operator-=(Derived& it, Difference n) {
+        return it += -n;
+    }
+
+    friend Derived operator+(Derived it, Difference n) {
+        return it += n;
+    }
+
+    friend Derived operator+(Difference n, Derived it) {
+        return it += n;
+    }
+
+    friend Derived operator-(Derived it, Difference n) {
+        return it -= n;
+    }
+
+    friend Difference operator-(const Derived& left, const Derived& right) {
+        return left.Distance(right);
+    }
+
+    friend bool operator!=(const Derived& left, const Derived& right) {
+        return !(left == right);
+    }
+
+    friend bool operator<(const Derived& left, const Derived& right) {
+        return left.Distance(right) < 0;
+    }
+
+    friend bool operator>(const Derived& left, const Derived& right) {
+        return right < left;
+    }
+
+    friend bool operator<=(const Derived& left, const Derived& right) {
+        return !(right < left);
+    }
+
+    friend bool operator>=(const Derived& left, const Derived& right) {
+        return !(left < right);
+    }
+};
+
+// function(element) of every element of Base, computed when dereferenced.
+template <typename Base, typename Function>
+class MapView {
+    using BaseIterator = decltype(std::declval<Base&>().begin());
+    using BaseTraits = std::iterator_traits<BaseIterator>;
+
+public:
+    class Iterator : public IteratorOperators<Iterator, typename BaseTraits::difference_type> {
+    public:
+        using iterator_category = CommonCategory<typename BaseTraits::iterator_category, std::random_access_iterator_tag>;
+        using difference_type = typename BaseTraits::difference_type;
+        using reference = decltype(std::declval<const Function&>()(*std::declval<BaseIterator>()));
+        using value_type = std::remove_cv_t<std::remove_reference_t<reference>>;
+        using pointer = void;
+
+        Iterator() = default;
+
+        Iterator(BaseIterator it, const Function* function) : m_It(it), m_Function(function) {
+        }
+
+        reference operator*() const {
+            return (*m_Function)(*m_It);
+        }
+
+        reference operator[](difference_type n) const {
+            return (*m_Function)(m_It[n]);
+        }
+
+        Iterator& operator++() {
+            ++m_It;
+            return *this;
+        }
+
+        Iterator& operator--() {
+            --m_It;
+            return *this;
+        }
+
+        Iterator& operator+=(difference_type n) {
+            m_It += n;
+            return *this;
+        }
+
+        difference_type Distance(const Iterator& other) const {
+            return m_It - other.m_It;
+        }
+
+        friend bool operator==(const Iterator& left, const Iterator& right) {
+            return left.m_It == right.m_It;
+        }
+
+    private:
+        BaseIterator m_It{};
+        const Function* m_Function = nullptr;
+    };
+
+    MapView(Base base, Function function) : m_Base(std::move(base)), m_Function(std::move(function)) {
+    }
+
+    Iterator begin() {
+        return Iterator(m_Base.begin(), &m_Function);
+    }
+
+    Iterator end() {
+        return Iterator(m_Base.end(), &m_Function);
+    }
+
+private:
+    Base m_Base;
+    Function m_Function;
+};
+
+// The elements of Base for which predicate is true, a forward range whatever Base is.
+template <typename Base, typename Predicate>
+class FilterView {
+    using BaseIterator = decltype(std::declval<Base&>().begin());
+
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = typename std::iterator_traits<BaseIterator>::difference_type;
+        using reference = decltype(*std::declval<BaseIterator>());
+        using value_type = std::remove_cv_t<std::remove_reference_t<reference>>;
+        using pointer = void;
+
+        Iterator() = default;
+
+        Iterator(BaseIterator it, BaseIterator last, const Predicate* predicate) : m_It(it), m_Last(last), m_Predicate(predicate) {
+            Skip();
+        }
+
+        reference operator*() const {
+            return *m_It;
+        }
+
+        Iterator& operator++() {
+            ++m_It;
+            Skip();
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        friend bool operator==(const Iterator& left, const Iterator& right) {
+            return left.m_It == right.m_It;
+        }
+
+        friend bool operator!=(const Iterator& left, const Iterator& right) {
+            return !(left == right);
+        }
+
+    private:
+        void Skip() {
+            while (m_It != m_Last && !(*m_Predicate)(*m_It)) {
+                ++m_It;
+            }
+        }
+
+        BaseIterator m_It{};
+        BaseIterator m_Last{};
+        const Predicate* m_Predicate = nullptr;
+    };
+
+    FilterView(Base base, Predicate predicate) : m_Base(std::move(base)), m_Predicate(std::move(predicate)) {
+    }
+
+    Iterator begin() {
+        return Iterator(m_Base.begin(), m_Base.end(), &m_Predicate);
+    }
+
+    Iterator end() {
+        return Iterator(m_Base.end(), m_Base.end(), &m_Predicate);
+    }
+
+private:
+    Base m_Base;
+    Predicate m_Predicate;
+};
+
+// Pairs of the elements of First and Second at the same position, as long as the shorter one.
+template <typename First, typename Second>
+class ZipView {
+    using FirstIterator = decltype(std::declval<First&>().begin());
+    using SecondIterator = decltype(std::declval<Second&>().begin());
+    using FirstTraits = std::iterator_traits<FirstIterator>;
+    using SecondTraits = std::iterator_traits<SecondIterator>;
+
+public:
+    class Iterator : public IteratorOperators<Iterator, std::ptrdiff_t> {
+    public:
+        using iterator_category = CommonCategory<typename FirstTraits::iterator_category, typename SecondTraits::iterator_category>;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::pair<decltype(*std::declval<FirstIterator>()), decltype(*std::declval<SecondIterator>())>;
+        using value_type = std::pair<typename FirstTraits::value_type, typename SecondTraits::value_type>;
+        using pointer = void;
+
+        Iterator() = default;
+
+        Iterator(FirstIterator first, SecondIterator second) : m_First(first), m_Second(second) {
+        }
+
+        reference operator*() const {
+            return reference(*m_First, *m_Second);
+        }
+
+        reference operator[](difference_type n) const {
+            return reference(m_First[n], m_Second[n]);
+        }
+
+        Iterator& operator++() {
+            ++m_First;
+            ++m_Second;
+            return *this;
+        }
+
+        Iterator& operator--() {
+            --m_First;
+            --m_Second;
+            return *this;
+        }
+
+        Iterator& operator+=(difference_type n) {
+            m_First += n;
+            m_Second += n;
+            return *this;
+        }
+
+        difference_type Distance(const Iterator& other) const {
+            return std::min<difference_type>(m_First - other.m_First, m_Second - other.m_Second);
+        }
+
+        // Either side at its end ends the zip.
+        friend bool operator==(const Iterator& left, const Iterator& right) {
+            return left.m_First == right.m_First || left.m_Second == right.m_Second;
+        }
+
+    private:
+        FirstIterator m_First{};
+        SecondIterator m_Second{};
+    };
+
+    ZipView(First first, Second second) : m_First(std::move(first)), m_Second(std::move(second)) {
+    }
+
+    Iterator begin() {
+        return Iterator(m_First.begin(), m_Second.begin());
+    }
+
+    Iterator end() {
+        if constexpr (std::is_same<typename Iterator::iterator_category, std::random_access_iterator_tag>::value) {
+            // Both ends at the shorter length, so that end() - begin() is the length.
+            const auto size = std::min<std::ptrdiff_t>(m_First.end() - m_First.begin(), m_Second.end() - m_Second.begin());
+            return Iterator(m_First.begin() + size, m_Second.begin() + size);
+        } else {
+            return Iterator(m_First.end(), m_Second.end());
+        }
+    }
+
+private:
+    First m_First;
+    Second m_Second;
+};
+
+// The first count elements of Base. Over a random access range the iterators are those of Base.
+template <typename Base>
+class TakeView {
+    using BaseIterator = decltype(std::declval<Base&>().begin());
+    static constexpr bool RandomAccess =
+        std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<BaseIterator>::iterator_category>::value;
+
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = typename std::iterator_traits<BaseIterator>::difference_type;
+        using reference = decltype(*std::declval<BaseIterator>());
+        using value_type = std::remove_cv_t<std::remove_reference_t<reference>>;
+        using pointer = void;
+
+        Iterator() = default;
+
+        Iterator(BaseIterator it, size_t left) : m_It(it), m_Left(left) {
+        }
+
+        reference operator*() const {
+            return *m_It;
+        }
+
+        Iterator& operator++() {
+            ++m_It;
+            --m_Left;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        // Ends after count elements, or with Base.
+        friend bool operator==(const Iterator& left, const Iterator& right) {
+            return left.m_Left == right.m_Left || left.m_It == right.m_It;
+        }
+
+        friend bool operator!=(const Iterator& left, const Iterator& right) {
+            return !(left == right);
+        }
+
+    private:
+        BaseIterator m_It{};
+        size_t m_Left = 0;
+    };
+
+    TakeView(Base base, size_t count) : m_Base(std::move(base)), m_Count(count) {
+    }
+
+    auto begin() {
+        if constexpr (RandomAccess) {
+            return m_Base.begin();
+        } else {
+            return Iterator(m_Base.begin(), m_Count);
+        }
+    }
+
+    auto end() {
+        if constexpr (RandomAccess) {
+            const auto first = m_Base.begin();
+            return first + std::min<std::ptrdiff_t>(m_Base.end() - first, static_cast<std::ptrdiff_t>(m_Count));
+        } else {
+            return Iterator(m_Base.end(), 0);
+        }
+    }
+
+private:
+    Base m_Base;
+    size_t m_Count;
+};
+
+template <typename Function>
+class MapAdaptor : public ViewAdaptor {
+public:
+    explicit MapAdaptor(Function function) : m_Function(std::move(function)) {
+    }
+
+    template <typename Base>
+    auto operator()(Base base) const {
+        return MapView<Base, Function>(std::move(base), m_Function);
+    }
+
+private:
+    Function m_Function;
+};
+
+template <typename Predicate>
+class FilterAdaptor : public ViewAdaptor {
+public:
+    explicit FilterAdaptor(Predicate predicate) : m_Predicate(std::move(predicate)) {
+    }
+
+    template <typename Base>
+    auto operator()(Base base) const {
+        return FilterView<Base, Predicate>(std::move(base), m_Predicate);
+    }
+
+private:
+    Predicate m_Predicate;
+};
+
+template <typename Other>
+class ZipAdaptor : public ViewAdaptor {
+public:
+    explicit ZipAdaptor(Other other) : m_Other(std::move(other)) {
+    }
+
+    template <typename Base>
+    auto operator()(Base base) const {
+        return ZipView<Base, Other>(std::move(base), m_Other);
+    }
+
+private:
+    Other m_Other;
+};
+
+class TakeAdaptor : public ViewAdaptor {
+public:
+    explicit TakeAdaptor(size_t count) : m_Count(count) {
+    }
+
+    template <typename Base>
+    auto operator()(Base base) const {
+        return TakeView<Base>(std::move(base), m_Count);
+    }
+
+private:
+    size_t m_Count;
+};
+
+/// \brief View of function(element) for every element, keeps random access.
+template <typename Function>
+MapAdaptor<Function> Map(Function function) {
+    return MapAdaptor<Function>(std::move(function));
+}
+
+/// \brief View of the elements for which predicate is true, a forward range.
+template <typename Predicate>
+FilterAdaptor<Predicate> Filter(Predicate predicate) {
+    return FilterAdaptor<Predicate>(std::move(predicate));
+}
+
+/// \brief View of pairs of an element and the element of other at the same position, keeps random access if both
+/// have it. other is referred to by its iterators when an lvalue, so it has to outlive the view.
+template <typename Other>
+auto Zip(Other&& other) {
+    return ZipAdaptor<AllOf<Other>>(All(std::forward<Other>(other)));
+}
+
+/// \brief View of the first count elements, keeps random access.
+inline TakeAdaptor Take(size_t count) {
+    return TakeAdaptor(count);
+}
+
 }  // namespace Utils
 
 namespace Iterable_T {
 
+// Elements behind pointers of their own, Iterator is the only way through.
+template <typename T>
+struct Indirect {
+    std::vector<std::unique_ptr<T>> elements;
+    size_t Count() const {
+        return elements.size();
+    }
+    T& Get(size_t index) {
+        return *elements[index];
+    }
+};
+
+// Enough of a pool for the parallel algorithms, a thread per task.
+struct Threads {
+    std::vector<std::thread> threads;
+    template <typename Task>
+    void AddTask(Task&& task) {
+        threads.emplace_back(std::forward<Task>(task));
+    }
+    size_t MaxConcurrency() const {
+        return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    ~Threads() {
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+};
+
 void TCase0() {
     std::vector<int> vec = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
     using size_type = decltype(std::declval<std::vector<int>>().size());
@@ -109,7 +969,7 @@ void TCase1() {
             p = new int[SIZE]{0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
         }
         ~TestClass() {
-            delete p;
+            delete[] p;
         }
         int GetSize() const {
             return SIZE;
@@ -130,6 +990,165 @@ void TCase1() {
     }
 }
 
+void TCase2() {
+    Indirect<int> indirect;
+    for (auto value : {5, 3, 9, 1, 7, 3, 8}) {
+        indirect.elements.emplace_back(new int(value));
+    }
+    auto it = Utils::MakeIterable<Indirect<int>, int, size_t, &Indirect<int>::Count, &Indirect<int>::Get>(indirect);
+    using Iterator = decltype(it.begin());
+    static_assert(!decltype(it)::Contiguous, "Get follows pointers");
+    static_assert(std::is_same<std::iterator_traits<Iterator>::iterator_category, std::random_access_iterator_tag>::value, "random access");
+    std::sort(it.begin(), it.end());
+    assert(std::is_sorted(it.begin(), it.end()));
+    assert(it.end() - it.begin() == 7);
+    assert(std::lower_bound(it.begin(), it.end(), 7) - it.begin() == 4);
+    assert(it.begin()[4] == 7 && *(it.end() - 1) == 9 && *(2 + it.begin()) == 3);
+    auto middle = it.begin() + 3;
+    assert(it.begin() < middle && middle <= middle && it.end() > middle && middle - 3 == it.begin());
+}
+
+void TCase3() {
+    std::vector<int> vec = {9, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+    using size_type = std::vector<int>::size_type;
+    auto it = Utils::MakeIterable<std::vector<int>, int, size_type, &std::vector<int>::size, &std::vector<int>::at>(vec);
+    static_assert(std::is_same<decltype(it.begin()), int*>::value, "at of std::vector collapses to a pointer");
+    assert(it.begin() == vec.data() && it.end() == vec.data() + vec.size());
+    std::sort(it.begin(), it.end());
+    assert(std::is_sorted(vec.begin(), vec.end()));
+    auto subscript = Utils::MakeIterable<std::vector<int>, int, size_type, &std::vector<int>::size, &std::vector<int>::operator[]>(vec);
+    static_assert(decltype(subscript)::Contiguous, "operator[] of std::vector is contiguous too");
+    assert(std::accumulate(subscript.begin(), subscript.end(), 0) == 45);
+}
+
+void TCase4() {
+    constexpr size_t N = 100000;
+    Indirect<double> indirect;
+    for (size_t i = 0; i < N; ++i) {
+        indirect.elements.emplace_back(new double(1.0 / (i + 1)));
+    }
+    auto it = Utils::MakeIterable<Indirect<double>, double, size_t, &Indirect<double>::Count, &Indirect<double>::Get>(indirect);
+    Threads pool;
+    Utils::ParallelForEach(pool, it, [](double& e) { e *= 2; });
+    assert(*indirect.elements[0] == 2.0 && *indirect.elements[N - 1] == 2.0 / N);
+    // Same blocks, same order of the additions, the same bits whatever the number of threads.
+    auto sum = [&](size_t concurrency) { return Utils::ParallelTransformReduce(pool, it, 0.0, std::plus<>(), [](double e) { return e; }, 0, concurrency); };
+    const double one = sum(1);
+    assert(one == sum(4) && one == sum(16));
+    assert(std::abs(one - std::accumulate(it.begin(), it.end(), 0.0)) < 1e-9);
+    // Chunks of a slice, an element costing more than the others, and an exception.
+    std::vector<int> vec(1000, 1);
+    auto ints = Utils::MakeIterable<std::vector<int>, int, size_t, &std::vector<int>::size, &std::vector<int>::at>(vec);
+    auto slice = ints.Slice(100, 900);
+    assert(slice.size() == 800);
+    assert(Utils::ParallelTransformReduce(pool, slice, 0, std::plus<>(), [](int e) { return e; }, 7, 3) == 800);
+    Utils::ParallelForEach(pool, ints, [&vec](int& e) {
+        if (&e == &vec[10]) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ++e;
+    });
+    assert(std::count(vec.begin(), vec.end(), 2) == 1000);
+    bool thrown = false;
+    try {
+        Utils::ParallelForEach(pool, ints, [](int& e) {
+            if (e == 2) {
+                throw std::runtime_error("element");
+            }
+        });
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void TCase5() {
+    std::vector<int> vec(100);
+    std::iota(vec.begin(), vec.end(), 0);
+    std::vector<double> weights(50, 0.5);
+    auto it = Utils::MakeIterable<std::vector<int>, int, size_t, &std::vector<int>::size, &std::vector<int>::at>(vec);
+    // Map, filter, zip and take in one pass.
+    int calls = 0;
+    auto view = it | Utils::Map([&calls](int e) {
+                    ++calls;
+                    return e * 3;
+                }) |
+                Utils::Filter([](int e) { return e % 2 == 0; }) | Utils::Zip(weights) | Utils::Take(10);
+    double sum = 0;
+    int count = 0;
+    for (auto pair : view) {
+        assert(pair.first == count * 6 && pair.second == 0.5);
+        sum += pair.first * pair.second;
+        ++count;
+    }
+    assert(count == 10 && sum == 135 && calls <= 2 * 20);
+    // Map, zip and take keep random access, and write through to the elements.
+    auto mapped = it | Utils::Map([](int e) { return e + 1; });
+    using Category = std::iterator_traits<decltype(mapped.begin())>::iterator_category;
+    static_assert(std::is_same<Category, std::random_access_iterator_tag>::value, "map keeps random access");
+    assert(mapped.end() - mapped.begin() == 100 && mapped.begin()[41] == 42);
+    assert(*std::lower_bound(mapped.begin(), mapped.end(), 57) == 57);
+    auto zipped = vec | Utils::Zip(weights);
+    static_assert(std::is_same<std::iterator_traits<decltype(zipped.begin())>::iterator_category, std::random_access_iterator_tag>::value, "zip too");
+    assert(zipped.end() - zipped.begin() == 50);
+    for (auto pair : zipped | Utils::Take(5)) {
+        pair.first = -1;
+        pair.second = 2;
+    }
+    assert(vec[4] == -1 && vec[5] == 5 && weights[4] == 2 && weights[5] == 0.5);
+    auto filtered = vec | Utils::Filter([](int e) { return e > 90; });
+    static_assert(std::is_same<std::iterator_traits<decltype(filtered.begin())>::iterator_category, std::forward_iterator_tag>::value, "filter does not");
+    assert(std::distance(filtered.begin(), filtered.end()) == 9);
+    // Of an rvalue the view keeps its own copy.
+    auto owned = std::vector<int>{1, 2, 3} | Utils::Map([](int e) { return e * e; });
+    assert(std::accumulate(owned.begin(), owned.end(), 0) == 14);
+    auto first = std::vector<int>{1, 2, 3, 4} | Utils::Map([](int e) { return e * 10; }) | Utils::Take(2);
+    assert(first.end() - first.begin() == 2 && first.begin()[1] == 20);
+}
+
+void TCase6() {
+    // Behind a pointer, but side by side.
+    struct Packed {
+        std::vector<int> storage;
+        size_t Count() const {
+            return storage.size();
+        }
+        int& Get(size_t index) {
+            return *(storage.data() + index);
+        }
+    };
+
+    constexpr size_t N = 1000;
+    Indirect<int> indirect;
+    Packed packed;
+    for (size_t i = 0; i < N; ++i) {
+        indirect.elements.emplace_back(new int(static_cast<int>(i)));
+        packed.storage.push_back(static_cast<int>(i));
+    }
+    auto sum = [](auto& iterable, const int* storage, size_t distance) {
+        long total = 0;
+        size_t blocks = 0;
+        iterable.template ForEachBlock<16>(
+            [&](const int* block, size_t count) {
+                assert(count == 16 || (count == N % 16 && blocks == N / 16));
+                assert((storage == nullptr) != (block == storage + blocks * 16));
+                for (size_t i = 0; i < count; ++i) {
+                    total += block[i];
+                }
+                ++blocks;
+            },
+            distance);
+        return total;
+    };
+    auto indirect_it = Utils::MakeIterable<Indirect<int>, int, size_t, &Indirect<int>::Count, &Indirect<int>::Get>(indirect);
+    auto packed_it = Utils::MakeIterable<Packed, int, size_t, &Packed::Count, &Packed::Get>(packed);
+    auto vector_it = Utils::MakeIterable<std::vector<int>, int, size_t, &std::vector<int>::size, &std::vector<int>::at>(packed.storage);
+    assert(sum(indirect_it, nullptr, 64) == N * (N - 1) / 2);
+    assert(sum(indirect_it, nullptr, 0) == N * (N - 1) / 2);
+    assert(sum(packed_it, packed.storage.data(), 16) == N * (N - 1) / 2);
+    assert(sum(vector_it, packed.storage.data(), 16) == N * (N - 1) / 2);
+}
+
 }  // namespace Iterable_T
 
 void Iterable_Test() {
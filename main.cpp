@@ -1,6 +1,11 @@
+#include <cstring>
 #include "Common.h"
 
-int main() {
+int main(int argc, char* argv[]) {
+    // "Miscellaneous benchmark [options]" runs the benchmarks instead of the tests, exits nonzero on a bad option.
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        return Benchmark(AsynTask, argc - 2, argv + 2);
+    }
     Test(RangeLoop);
     Test(Iterable);
     Test(CPolymorphism);